@@ -1,25 +1,133 @@
 #include "cinder/app/AppNative.h"
 #include "cinder/gl/Texture.h"
 #include "cinder/gl/gl.h"
+#include "cinder/gl/Vbo.h"
 #include "Cinder-OpenNI.h"
 #include "CinderOpenCV.h"
 #include "cinder/params/Params.h"
+#include "cinder/Utilities.h"
 #include "Shape.h"
+#include "Logger.h"
+#include "TrackEvents.h"
+#include "Tracker.h"
+#include "DepthRecording.h"
+#include "FlightRecorder.h"
+#include "BatchRunner.h"
+#include "TrajectoryLog.h"
+#include "TrajectoryIndex.h"
+#include "OccupancyHeatmap.h"
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <thread>
 
 using namespace ci;
 using namespace ci::app;
 using namespace std;
 
+// set from a SIGUSR1 handler, picked up by the depth thread
+static volatile sig_atomic_t sFlightDumpSignal = 0;
+
+static void onFlightDumpSignal( int ){
+    sFlightDumpSignal = 1;
+}
+
+// local "YYYY-MM-DD HH:MM[:SS]" to microseconds since 1970, 0 if malformed
+static uint64_t parseWallClock( const string &text ){
+    struct tm fields = {};
+    if( strptime( text.c_str(), "%Y-%m-%d %H:%M:%S", &fields ) == NULL && strptime( text.c_str(), "%Y-%m-%d %H:%M", &fields ) == NULL ){
+        return 0;
+    }
+    fields.tm_isdst = -1;
+    time_t seconds = mktime( &fields );
+    return seconds < 0 ? 0 : (uint64_t)seconds * 1000000;
+}
+
+// listens where the app sends its track events, a UDP port on localhost or a
+// unix socket path, and prints ordering and latency once a second; runs for
+// seconds, or until killed when 0
+static bool receiveEvents( const string &endpoint, int seconds ){
+    TrackEventReceiver receiver;
+    bool port = ! endpoint.empty() && endpoint.find_first_not_of( "0123456789" ) == string::npos;
+    if( ! ( port ? receiver.bindUdp( atoi( endpoint.c_str() ) ) : receiver.bindUnix( endpoint ) ) ){
+        MT_LOG_ERROR( "receiver: could not bind" );
+        return false;
+    }
+    printf( "packets,events,gaps,reordered,malformed,send_ms_mean,send_ms_max,receive_ms_mean,receive_ms_max\n" );
+    uint64_t start = TrackEventSender::hostTimeMicros();
+    uint64_t nextReport = start + 1000000;
+    vector<TrackEvent> events;
+    for(;;){
+        events.clear();
+        receiver.receive( events, 100 );
+        uint64_t now = TrackEventSender::hostTimeMicros();
+        if( now >= nextReport ){
+            const TrackEventReceiver::Stats &s = receiver.getStats();
+            printf( "%llu,%llu,%llu,%llu,%llu,%.2f,%.2f,%.2f,%.2f\n", (unsigned long long)s.packets, (unsigned long long)s.events,
+                (unsigned long long)s.gaps, (unsigned long long)s.reordered, (unsigned long long)s.malformed,
+                s.meanSendLatencyMs, s.maxSendLatencyMs, s.meanReceiveLatencyMs, s.maxReceiveLatencyMs );
+            fflush( stdout );
+            nextReport += 1000000;
+            if( seconds > 0 && now - start >= (uint64_t)seconds * 1000000 ){
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+// brings the index saved next to the log up to date, then prints the IDs of
+// tracks that entered rect between the two local times
+static bool queryTrajectories( const string &logPath, const string &from, const string &to, const cv::Rect &rect ){
+    TrajectoryLogReader log;
+    if( ! log.open( logPath ) ){
+        return false;
+    }
+    uint64_t begin = parseWallClock( from );
+    uint64_t end = parseWallClock( to );
+    if( begin == 0 || end < begin ){
+        MT_LOG_ERROR( "query: times must be YYYY-MM-DD HH:MM[:SS], from before to" );
+        return false;
+    }
+    if( log.getEpoch() == 0 ){
+        MT_LOG_ERROR( "query: log has no wall-clock epoch" );
+        return false;
+    }
+
+    string indexPath = logPath + ".idx";
+    TrajectoryIndex index;
+    index.load( indexPath );
+    index.update( log );
+    index.save( indexPath );
+
+    // sensor timestamps are this session's wall-clock time less the epoch
+    uint64_t epoch = log.getEpoch();
+    uint64_t sensorBegin = begin > epoch ? begin - epoch : 0;
+    uint64_t sensorEnd = end > epoch ? end - epoch : 0;
+    vector<int32_t> IDs = index.query( log, sensorBegin, sensorEnd, rect );
+    printf( "%zu tracks\n", IDs.size() );
+    for( int32_t ID : IDs ){
+        printf( "%d\n", ID );
+    }
+    return true;
+}
+
 class MotionTrackingTestApp : public AppNative {
   public:
 	void setup();
     void prepareSettings( Settings* settings );
-   // void keyDown( KeyEvent event );
+    void keyDown( KeyEvent event );
+    void shutdown();
     void onDepth( openni::VideoFrameRef frame, const OpenNI::DeviceOptions& deviceOptions );
     void onColor( openni::VideoFrameRef frame, const OpenNI::DeviceOptions& deviceOptions );
-    vector< Shape > getEvaluationSet( vector< vector<cv::Point> > rawContours, int minimalArea, int maxArea );
-    Shape* findNearestMatch( Shape trackedShape, vector< Shape > &shapes, float maximumDistance  );
-    cv::Mat removeBlack( cv::Mat input, short nearLimit, short farLimit );
+    void processDepth( const cv::Mat &depth, uint64_t timestamp );
+    void replay();
+    void packGeometry();
+    void uploadTexture( gl::TextureRef &texture, const cv::Mat &image );
 	void update();
 	void draw();
     
@@ -27,41 +135,162 @@ class MotionTrackingTestApp : public AppNative {
     OpenNI::DeviceManagerRef mDeviceManager;
     
     ci::Surface8u mSurface;
-    ci::Surface8u mSurfaceDepth;
-    ci::Surface8u mSurfaceBlur;
-    ci::Surface8u mSurfaceSubtract;
     gl::TextureRef mTexture;
     gl::TextureRef mTextureDepth;
-    
-    cv::Mat mPreviousFrame;
-    cv::Mat mBackground;
+    gl::TextureRef mTextureBlur;
+    gl::TextureRef mTextureSubtract;
+    gl::TextureRef mTextureHeatmap;
     
     params::InterfaceGlRef mParams;
     double mThresh;
     double mMaxVal;
     short mNearLimit;
     short mFarLimit;
+    // tracks not matched for this long (in sensor time) are dropped
+    int mTrackExpiryMs;
+    bool mFloorSegmentation;
+    float mMinHeight;
+    float mFloorMaxTilt;
+    bool mTopDownGrid;
+    int mSplitArea;
+    bool mTrackHeads;
+    float mMotionThreshold;
+    bool mIdle;
+    int32_t mIdlePeriods;
+    float mIdleSeconds;
+    int32_t mSkippedFrames;
+    float mWakeLatencyMs;
+    bool mRoiTracking;
+    bool mOpticalFlow;
+    float mCandidatesPerTrack;
+    int mLogLevel;
+    // processing slower than this dumps the flight recorder
+    float mDumpLatencyMs;
+    float mHeatmapHalfLife;
+    float mHeatmapSnapshotSeconds;
+    
+    Tracker mTracker;
+    // show control receives track enter/update/exit events here
+    TrackEventSender mEventSender;
+    FlightRecorder mFlightRecorder;
+    // every live track's path, for analytics
+    TrajectoryLogWriter mTrajectoryLog;
+    // where people dwell, snapshotted to Documents/heatmap-latest.pgm
+    OccupancyHeatmap mHeatmap;
+    uint32_t mHeatmapId;
+    std::atomic<bool> mFlightDumpRequested;
+    int mFlightRecorderSeconds;
+    
+    // depth recording replayed instead of a live device; kept open for the
+    // app's lifetime since published frames may point into the mapping
+    DepthRecordingMap mReplayRecording;
+    std::thread mReplayThread;
+    std::atomic<bool> mReplayRunning;
+    // relative jump requested from the keyboard, applied by the replay thread
+    std::atomic<int> mReplaySeekMs;
   private:
-    typedef vector< vector<cv::Point > > ContourVector;
-    ContourVector mContours;
-    ContourVector mApproxContours;
+    // contour loops and tracked hull points packed for a single VBO upload
+    struct FrameGeometry {
+        FrameGeometry() : hullFirst( 0 ), hullCount( 0 ) {}
+        
+        vector<GLshort> vertices;
+        vector<GLint> loopFirsts;
+        vector<GLsizei> loopCounts;
+        GLint hullFirst;
+        GLsizei hullCount;
+    };
+    
+    typedef Tracker::ContourVector ContourVector;
     int mStepSize;
     int mBlurAmount;
-    int shapeUID;
     
-    cv::Mat mInput;
-    cv::vector<cv::Vec4i> mHierarchy;
-    vector<Shape> mShapes;
-    vector<Shape> mTrackedShapes;
+    // written by onDepth, handed to draw() under mPublishMutex
+    std::mutex mPublishMutex;
+    cv::Mat mPublishedDepth;
+    cv::Mat mPublishedBlur;
+    cv::Mat mPublishedSubtract;
+    FrameGeometry mPendingGeometry;
+    FrameGeometry mPublishedGeometry;
+    uint32_t mPublishedFrameId;
+    
+    FrameGeometry mGeometry;
+    uint32_t mUploadedFrameId;
+    gl::Vbo mGeometryVbo;
 };
 
 void MotionTrackingTestApp::setup(){
     mDeviceManager = OpenNI::DeviceManager::create();
     
-    shapeUID = 0;
-    mTrackedShapes.clear();
+    mPublishedFrameId = 0;
+    mUploadedFrameId = 0;
+    mGeometryVbo = gl::Vbo( GL_ARRAY_BUFFER );
+    mEventSender.openUdp( "127.0.0.1", 7000 );
+    mFlightDumpRequested = false;
+    mFlightRecorderSeconds = 10;
+    mReplayRunning = false;
+    mReplaySeekMs = 0;
+    signal( SIGUSR1, onFlightDumpSignal );
+    
+    Tracker::Params trackerParams;
+    mThresh = trackerParams.thresh;
+    mMaxVal = trackerParams.maxVal;
+    mNearLimit = trackerParams.nearLimit;
+    mFarLimit = trackerParams.farLimit;
+    mTrackExpiryMs = trackerParams.trackExpiryMs;
+    mFloorSegmentation = trackerParams.floorSegmentation;
+    mMinHeight = trackerParams.minHeight;
+    mFloorMaxTilt = trackerParams.floorMaxTilt;
+    mTopDownGrid = trackerParams.topDownGrid;
+    mSplitArea = trackerParams.splitArea;
+    mTrackHeads = trackerParams.trackHeads;
+    mMotionThreshold = trackerParams.motionThreshold;
+    mIdle = false;
+    mIdlePeriods = 0;
+    mIdleSeconds = 0.0f;
+    mSkippedFrames = 0;
+    mWakeLatencyMs = 0.0f;
+    mRoiTracking = trackerParams.roiTracking;
+    mOpticalFlow = trackerParams.opticalFlow;
+    mCandidatesPerTrack = 0.0f;
+    mLogLevel = Logger::instance().getLevel();
+    mDumpLatencyMs = 100.0f;
+    mHeatmapHalfLife = 600.0f;
+    mHeatmapSnapshotSeconds = 60.0f;
+    mHeatmapId = 0;
     
-    if( mDeviceManager->isInitialized() ){
+    // --classifier <model> drops blobs the trained model says aren't people;
+    // loaded before anything feeds the tracker
+    const vector<string> &args = getArgs();
+    for( size_t i = 0; i + 1 < args.size(); i++ ){
+        if( args[i] == "--classifier" ){
+            mTracker.loadClassifier( args[i + 1] );
+        }
+    }
+    
+    // --replay <file.mtdr> runs the tracker over a recording instead of the sensor
+    for( size_t i = 0; i + 1 < args.size(); i++ ){
+        if( args[i] == "--replay" ){
+            mReplayRunning = true;
+            if( mReplayRecording.open( args[i + 1] ) && mReplayRecording.getFrameCount() > 0 ){
+                // project with the intrinsics the recording was made with; set
+                // here, before update() starts copying params back and forth
+                Tracker::Params params = mTracker.getParams();
+                params.horizontalFov = mReplayRecording.getInfo().horizontalFov;
+                params.verticalFov = mReplayRecording.getInfo().verticalFov;
+                mTracker.setParams( params );
+                mReplayThread = std::thread( &MotionTrackingTestApp::replay, this );
+            }
+        }
+    }
+    
+    if( ! mReplayRunning ){
+        char name[64];
+        time_t now = time( NULL );
+        strftime( name, sizeof( name ), "trajectories-%Y%m%d-%H%M%S.mttl", localtime( &now ) );
+        mTrajectoryLog.open( ( getDocumentsDirectory() / name ).string() );
+    }
+    
+    if( ! mReplayRunning && mDeviceManager->isInitialized() ){
         try{
             mDevice = mDeviceManager->createDevice( OpenNI::DeviceOptions().enableColor() );
         } catch( OpenNI::ExcDeviceNotAvailable ex) {
@@ -71,22 +300,39 @@ void MotionTrackingTestApp::setup(){
         }
         
         if( mDevice ){
+            Tracker::Params params = mTracker.getParams();
+            params.horizontalFov = mDevice->getDepthStream().getHorizontalFieldOfView();
+            params.verticalFov = mDevice->getDepthStream().getVerticalFieldOfView();
+            mTracker.setParams( params );
             mDevice->connectDepthEventHandler( &MotionTrackingTestApp::onDepth, this );
             mDevice->connectColorEventHandler( &MotionTrackingTestApp::onColor, this );
-         //   mBackground = cv::Mat( 240,320, CV_16UC1 );
-         //   mPreviousFrame = cv::Mat( 240,320, CV_16UC1 );
             mDevice->start();
         }
     }
     
-    mThresh = 0.0;
-    mMaxVal = 255.0;
-    mNearLimit = 30;
-    mFarLimit = 4000;
-    
     mParams = params::InterfaceGl::create("Threshold", Vec2i( 255, 200 ) );
     mParams->addParam("Thresh", &mThresh, "min=0.0f max=255.0f step=1.0 keyIncr=a keyDecr=s");
     mParams->addParam("Maxval", &mMaxVal, "min=0.0f max=255.0f step=1.0 keyIncr=q keyDecr=w");
+    mParams->addParam("Track expiry (ms)", &mTrackExpiryMs, "min=0 max=5000 step=10");
+    mParams->addParam("Floor segmentation", &mFloorSegmentation);
+    mParams->addParam("Min height (mm)", &mMinHeight, "min=0 max=2000 step=10");
+    mParams->addParam("Floor max tilt (deg)", &mFloorMaxTilt, "min=0 max=120 step=5");
+    mParams->addParam("Top-down grid", &mTopDownGrid);
+    mParams->addParam("Split area", &mSplitArea, "min=0 max=100000 step=500");
+    mParams->addParam("Track heads", &mTrackHeads);
+    mParams->addParam("Motion threshold (mm)", &mMotionThreshold, "min=0 max=200 step=1");
+    mParams->addParam("Idle", &mIdle, "", true);
+    mParams->addParam("Idle periods", &mIdlePeriods, "", true);
+    mParams->addParam("Idle time (s)", &mIdleSeconds, "", true);
+    mParams->addParam("Idle skipped frames", &mSkippedFrames, "", true);
+    mParams->addParam("Wake latency (ms)", &mWakeLatencyMs, "", true);
+    mParams->addParam("ROI tracking", &mRoiTracking);
+    mParams->addParam("Optical flow", &mOpticalFlow);
+    mParams->addParam("Candidates / track", &mCandidatesPerTrack, "", true);
+    mParams->addParam("Log level", &mLogLevel, "min=0 max=5 step=1");
+    mParams->addParam("Dump latency (ms)", &mDumpLatencyMs, "min=10 max=1000 step=10");
+    mParams->addParam("Heatmap half-life (s)", &mHeatmapHalfLife, "min=1 max=259200 step=60");
+    mParams->addParam("Heatmap snapshot (s)", &mHeatmapSnapshotSeconds, "min=1 max=3600 step=10");
     //mParams->addParam( "Black near", &mNearLimit, "min=10 max=100 step=1 keyIncr=t keyDecr=y" );
 //    mParams->addParam( "Black far", &mFarLimit, "min=200 max=1000 step=1 keyIncr=g keyDecr=h" );
     mStepSize = 10;
@@ -94,179 +340,314 @@ void MotionTrackingTestApp::setup(){
 }
 
 void MotionTrackingTestApp::prepareSettings( Settings* settings ){
+    // --batch <list> [--batch-grid <file>] [--batch-out <dir>] [--batch-threads <n>]
+    // [--classifier <model>] [--batch-samples] sweeps recordings headless and
+    // exits before a window opens
+    // --train-classifier <model> --samples <file.csv> [--samples ...] trains
+    // the blob classifier from labelled batch samples and exits
+    // --receive-events <port | socket path> [--receive-seconds <n>] checks
+    // the events another instance sends for gaps, reordering and latency,
+    // printing totals every second, and exits after n seconds if given
+    // --query <log.mttl> --query-from <time> --query-to <time>
+    // [--query-rect x,y,w,h] lists tracks in a trajectory log that entered
+    // the rect, the whole view by default, between two local times
+    // "YYYY-MM-DD HH:MM[:SS]" and exits
+    const vector<string> &args = getArgs();
+    string batchList;
+    string trainModel;
+    vector<string> trainSamples;
+    string queryLog, queryFrom, queryTo;
+    string receiveEndpoint;
+    int receiveSeconds = 0;
+    TrajectoryIndex::Params indexParams;
+    cv::Rect queryRect( 0, 0, indexParams.width, indexParams.height );
+    BatchRunner batch;
+    bool batchOk = true;
+    batch.setWriteSamples( std::find( args.begin(), args.end(), "--batch-samples" ) != args.end() );
+    for( size_t i = 0; i + 1 < args.size(); i++ ){
+        if( args[i] == "--receive-events" ){
+            receiveEndpoint = args[i + 1];
+        } else if( args[i] == "--receive-seconds" ){
+            receiveSeconds = atoi( args[i + 1].c_str() );
+        } else if( args[i] == "--query" ){
+            queryLog = args[i + 1];
+        } else if( args[i] == "--query-from" ){
+            queryFrom = args[i + 1];
+        } else if( args[i] == "--query-to" ){
+            queryTo = args[i + 1];
+        } else if( args[i] == "--query-rect" ){
+            sscanf( args[i + 1].c_str(), "%d,%d,%d,%d", &queryRect.x, &queryRect.y, &queryRect.width, &queryRect.height );
+        } else if( args[i] == "--train-classifier" ){
+            trainModel = args[i + 1];
+        } else if( args[i] == "--samples" ){
+            trainSamples.push_back( args[i + 1] );
+        } else if( args[i] == "--classifier" ){
+            batch.setClassifier( args[i + 1] );
+        } else if( args[i] == "--batch" ){
+            batchList = args[i + 1];
+        } else if( args[i] == "--batch-grid" ){
+            batchOk = batchOk && batch.loadGrid( args[i + 1] );
+        } else if( args[i] == "--batch-out" ){
+            batch.setOutputDirectory( args[i + 1] );
+        } else if( args[i] == "--batch-threads" ){
+            batch.setThreads( atoi( args[i + 1].c_str() ) );
+        }
+    }
+    if( ! receiveEndpoint.empty() ){
+        exit( receiveEvents( receiveEndpoint, receiveSeconds ) ? EXIT_SUCCESS : EXIT_FAILURE );
+    }
+    if( ! queryLog.empty() ){
+        exit( queryTrajectories( queryLog, queryFrom, queryTo, queryRect ) ? EXIT_SUCCESS : EXIT_FAILURE );
+    }
+    if( ! trainModel.empty() ){
+        exit( BlobClassifier::train( trainSamples, trainModel ) ? EXIT_SUCCESS : EXIT_FAILURE );
+    }
+    if( ! batchList.empty() ){
+        batchOk = batchOk && batch.loadRecordingList( batchList ) && batch.run();
+        exit( batchOk ? EXIT_SUCCESS : EXIT_FAILURE );
+    }
+    
     settings->setFrameRate( 60.0f );
     settings->setWindowSize( 800, 800 );
 }
 
-//void MotionTrackingTestApp::keyDown( KeyEvent event ){
-//    mPreviousFrame.copyTo( mBackground );
-//    mBackground = removeBlack( mBackground, mNearLimit, mFarLimit );
-//}
+void MotionTrackingTestApp::keyDown( KeyEvent event ){
+    // dump the flight recorder; handled on the depth thread
+    if( event.getChar() == 'd' ){
+        mFlightDumpRequested = true;
+    }
+    // scrub the replay five seconds at a time
+    if( event.getChar() == '[' ){
+        mReplaySeekMs -= 5000;
+    }
+    if( event.getChar() == ']' ){
+        mReplaySeekMs += 5000;
+    }
+}
+
+void MotionTrackingTestApp::shutdown(){
+    mReplayRunning = false;
+    if( mReplayThread.joinable() ){
+        mReplayThread.join();
+    }
+    if( mDevice ){
+        mDevice->stop();
+    }
+    mTrajectoryLog.close();
+}
 
 void MotionTrackingTestApp::onDepth( openni::VideoFrameRef frame, const OpenNI::DeviceOptions& deviceOptions){
-    mInput = toOcv( OpenNI::toChannel16u( frame ) );
-    
-    cv::Mat withoutBlack;
-    withoutBlack = removeBlack( mInput, mNearLimit, mFarLimit );
+    // sensor timestamp in microseconds, independent of the render loop
+    processDepth( toOcv( OpenNI::toChannel16u( frame ) ), frame.getTimestamp() );
+}
+
+// the recording is opened by setup()
+void MotionTrackingTestApp::replay(){    
+    size_t frame = 0;
+    uint64_t previousTimestamp = 0;
+    while( mReplayRunning ){
+        // wrap before seeking, a seek needs a valid frame to start from
+        if( frame == mReplayRecording.getFrameCount() ){
+            // loop the recording from a clean tracker state
+            frame = 0;
+            mTracker.reset();
+            previousTimestamp = 0;
+        }
+        int seekMs = mReplaySeekMs.exchange( 0 );
+        if( seekMs != 0 ){
+            int64_t target = (int64_t)mReplayRecording.getTimestamp( frame ) + (int64_t)seekMs * 1000;
+            frame = mReplayRecording.findFrame( std::max<int64_t>( target, 0 ) );
+            mTracker.reset();
+            previousTimestamp = 0;
+        }
+        
+        // a new Mat per frame, published frames keep a reference to it
+        cv::Mat depth;
+        uint64_t timestamp = mReplayRecording.getTimestamp( frame );
+        if( ! mReplayRecording.readFrame( frame++, depth ) ){
+            break;
+        }
+        
+        // pace frames by their recorded timestamps
+        if( previousTimestamp != 0 && timestamp > previousTimestamp ){
+            std::this_thread::sleep_for( std::chrono::microseconds( std::min<uint64_t>( timestamp - previousTimestamp, 1000000 ) ) );
+        }
+        previousTimestamp = timestamp;
+        processDepth( depth, timestamp );
+    }
+}
+
+void MotionTrackingTestApp::processDepth( const cv::Mat &depth, uint64_t timestamp ){
+    // the ring and the heatmap are sized on the first frame, then never
+    // allocate again; kept out of the timed region so the one-off
+    // allocation doesn't count against the latency threshold
+    if( mFlightRecorder.getCapacity() == 0 ){
+        Tracker::Params params = mTracker.getParams();
+        DepthRecordingInfo info;
+        info.width = depth.cols;
+        info.height = depth.rows;
+        info.horizontalFov = params.horizontalFov;
+        info.verticalFov = params.verticalFov;
+        mFlightRecorder.setup( mFlightRecorderSeconds * 30, info, getDocumentsDirectory().string() );
+    }
+    if( ! mHeatmap.isSetup() ){
+        mHeatmap.setup( depth.cols, depth.rows, mHeatmapHalfLife, mHeatmapSnapshotSeconds, getDocumentsDirectory().string() );
+    }
     
-    cv::Mat eightBit;
-    cv::Mat thresh;
+    uint64_t captureTime = TrackEventSender::hostTimeMicros();
     
-    // convert to RGB color space, with some compensation
-    withoutBlack.convertTo( eightBit, CV_8UC3, 0.1/1.0  );
-    cv::bitwise_not(eightBit, eightBit);
+    mTracker.process( depth, timestamp );
+    mEventSender.sendFrame( timestamp, captureTime, mTracker.getEvents() );
+    mTrajectoryLog.append( timestamp, mTracker.getTrackedShapes() );
     
-    mContours.clear();
-    mApproxContours.clear();
-    cv::threshold( eightBit, thresh, mThresh, mMaxVal, CV_8U );
-    cv::findContours( thresh, mContours, mHierarchy, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE );
+    mFlightRecorder.record( timestamp, depth, mTracker.getEvents() );
+    // an idle tracker skips the frame and keeps the last mask, which would
+    // otherwise pile up where the last person stood
+    mHeatmap.accumulate( mTracker.isIdle() ? cv::Mat() : mTracker.getForeground(), timestamp );
     
-    vector<cv::Point> approx;
-    // approx number of points per contour
-    for( int i=0; i<mContours.size(); i++ ) {
-        cv::approxPolyDP(mContours[i], approx, 3, true );
-        mApproxContours.push_back( approx );
+    float elapsedMs = ( TrackEventSender::hostTimeMicros() - captureTime ) / 1000.0f;
+    if( elapsedMs > mDumpLatencyMs ){
+        mFlightRecorder.trigger( "flight recorder: latency threshold exceeded" );
+    }
+    if( mFlightDumpRequested.exchange( false ) ){
+        mFlightRecorder.trigger( "flight recorder: dump requested" );
+    }
+    if( sFlightDumpSignal ){
+        sFlightDumpSignal = 0;
+        mFlightRecorder.trigger( "flight recorder: dump requested by signal" );
     }
     
-    // get data that we can later compare
-    mShapes.clear();
-    mShapes = getEvaluationSet( mApproxContours, 75, 100000 );
+    packGeometry();
     
-    // find the nearest match for each shape
-    for( int i = 0; i<mTrackedShapes.size(); i++ ){
-        Shape* nearestShape = findNearestMatch( mTrackedShapes[i], mShapes, 5000 );
-        
-        if( nearestShape != NULL){
-            // update our tracked contour
-            // last frame seen
-            nearestShape->matchFound = true;
-            mTrackedShapes[i].centroid = nearestShape->centroid;
-            mTrackedShapes[i].lastFrameSeen = ci::app::getElapsedFrames();
-            mTrackedShapes[i].hull.clear();
-            mTrackedShapes[i].hull = nearestShape->hull;
-        }
-    }
+    // every Mat here is freshly allocated per frame, so sharing the header is enough
+    std::lock_guard<std::mutex> lock( mPublishMutex );
+    mPublishedDepth = mTracker.getDepth();
+    mPublishedBlur = mTracker.getWithoutBlack();
+    mPublishedSubtract = mTracker.getEightBit();
+    std::swap( mPublishedGeometry, mPendingGeometry );
+    mPublishedFrameId++;
+}
+
+void MotionTrackingTestApp::packGeometry(){
+    FrameGeometry &geom = mPendingGeometry;
+    geom.vertices.clear();
+    geom.loopFirsts.clear();
+    geom.loopCounts.clear();
     
-    // if shape->matchFound is false, add it as a new shape
-    for( int i = 0; i<mShapes.size(); i++ ){
-        if( mShapes[i].matchFound == false ){
-            mShapes[i].ID = shapeUID;
-            mShapes[i].lastFrameSeen = ci::app::getElapsedFrames();
-            mTrackedShapes.push_back( mShapes[i]);
-            shapeUID++;
-//            std::cout << "adding a new tracked shape with ID: " << mShapes[i].ID << std::endl;
+    // contours as line loops
+    const ContourVector &contours = mTracker.getContours();
+    for( ContourVector::const_iterator iter = contours.begin(); iter != contours.end(); ++iter ){
+        geom.loopFirsts.push_back( geom.vertices.size() / 2 );
+        geom.loopCounts.push_back( iter->size() );
+        for( vector< cv::Point >::const_iterator pt = iter->begin(); pt != iter->end(); ++pt ){
+            geom.vertices.push_back( pt->x );
+            geom.vertices.push_back( pt->y );
         }
     }
     
-    // if we didnt find a match for x frames, delete the tracked shape
-    for( vector<Shape>::iterator it=mTrackedShapes.begin(); it!=mTrackedShapes.end(); ){
-//        std::cout << "tracked shapes size: " << mTrackedShapes.size() << std::endl;
-        if( ci::app::getElapsedFrames() - it->lastFrameSeen > 20 ){
-//            std::cout << "deleting shape with ID: " << it->ID << std::endl;
-            it = mTrackedShapes.erase(it);
-        } else {
-            ++it;
+    // tracked hulls as points, appended after the loops
+    geom.hullFirst = geom.vertices.size() / 2;
+    const vector<Shape> &trackedShapes = mTracker.getTrackedShapes();
+    for( int i=0; i<trackedShapes.size(); i++ ){
+        for( int j=0; j<trackedShapes[i].hull.size(); j++ ){
+            geom.vertices.push_back( trackedShapes[i].hull[j].x );
+            geom.vertices.push_back( trackedShapes[i].hull[j].y );
         }
     }
-    
-    cv::Mat gray8Bit;
-    withoutBlack.convertTo( gray8Bit, CV_8UC3, 0.1/1.0  );
-    
-    mSurfaceDepth = Surface8u( fromOcv( mInput  ) );
-    mSurfaceBlur = Surface8u( fromOcv( withoutBlack ) );
-    mSurfaceSubtract = Surface8u( fromOcv( eightBit ) );
+    geom.hullCount = geom.vertices.size() / 2 - geom.hullFirst;
 }
 
 void MotionTrackingTestApp::onColor(openni::VideoFrameRef frame, const OpenNI::DeviceOptions& deviceOptions){
     mSurface = OpenNI::toSurface8u( frame );
-    cv::Mat mInput( toOcv( OpenNI::toSurface8u( frame ), 0 ) );
+    // a new Mat per frame, the tracker keeps the previous one for flow; it is
+    // only used with flowFromColor, as the device isn't set to register color
+    // to depth
+    cv::Mat gray;
+    cv::cvtColor( toOcv( mSurface ), gray, CV_RGB2GRAY );
+    mTracker.setFlowImage( gray, frame.getTimestamp() );
 }
 
-vector< Shape > MotionTrackingTestApp::getEvaluationSet( vector< vector<cv::Point> > rawContours, int minimalArea, int maxArea ){
-    vector< Shape > vec;
-    for ( vector< cv::Point > &c : rawContours )
-    {
-        // create a matrix from the contour
-        cv::Mat matrix = cv::Mat( c );
-        
-        // extract data from contour
-        cv::Scalar center = mean( matrix );
-        double area = cv::contourArea( matrix );
-        
-        // reject it if too small
-        if ( area < minimalArea )
-            continue;
-        
-        // reject it if too big
-        if ( area > maxArea )
-            continue;
-        
-        // store data
-        Shape shape;
-        shape.area = area;
-        shape.centroid = cv::Point(center.val[0], center.val[1]);
-        
-        // convex hull is the polygon enclosing the contour
-        shape.hull = c;
-        console() << "shape points: " << shape.hull.size() << endl;
-        shape.matchFound = false;
-        vec.push_back( shape );
-    }
-    return vec;
-}
-
-Shape* MotionTrackingTestApp::findNearestMatch( Shape trackedShape, vector< Shape > &shapes, float maximumDistance  )
+// uploads a 16-bit or 8-bit single channel image as luminance, reusing the texture
+void MotionTrackingTestApp::uploadTexture( gl::TextureRef &texture, const cv::Mat &image )
 {
-    Shape* closestShape = NULL;
-    float nearestDist = 1e5;
-    if ( shapes.empty() ){
-        return NULL;
+    if( image.empty() ){
+        return;
     }
     
-    for ( Shape &candidate : shapes )
-    {
-        // find dist between the center of the contour and the shape
-        cv::Point distPoint = trackedShape.centroid - candidate.centroid;
-        float dist = cv::sqrt( distPoint.x*distPoint.x + distPoint.y*distPoint.y );
-        if ( dist > maximumDistance )
-            continue;
-        
-        if ( candidate.matchFound )
-            continue;
-        
-        if ( dist < nearestDist )
-        {
-            nearestDist = dist;
-            closestShape = &candidate;
-        }
+    bool sixteenBit = image.depth() == CV_16U || image.depth() == CV_16S;
+    if( ! texture || texture->getWidth() != image.cols || texture->getHeight() != image.rows ){
+        gl::Texture::Format format;
+        format.setInternalFormat( sixteenBit ? GL_LUMINANCE16 : GL_LUMINANCE8 );
+        texture = gl::Texture::create( image.cols, image.rows, format );
     }
-    return closestShape;
-}
-
-cv::Mat MotionTrackingTestApp::removeBlack( cv::Mat input, short nearLimit, short farLimit )
-{
-    int counter = 0;
     
-    for( int y=0; y<input.rows; y++ ){
-        for( int x=0; x<input.cols; x++ ){
-//            short color = input.at<int>(y,x);
-  //          std::cout << "color " << color << std::endl;
-            if( input.at<short>(y,x) < nearLimit || input.at<short>(y,x) > farLimit){
-                input.at<short>(y,x) = 4000;
-//                std::cout << "color after " << input.at<short>(y,x) << std::endl;
-            }
-        }
-    }
-//    console() << "counter " << counter << endl;
-    return input;
+    texture->bind();
+    glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+    glPixelStorei( GL_UNPACK_ROW_LENGTH, image.step / image.elemSize() );
+    glTexSubImage2D( texture->getTarget(), 0, 0, 0, image.cols, image.rows, GL_LUMINANCE, sixteenBit ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE, image.data );
+    glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
+    glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+    texture->unbind();
 }
 
 void MotionTrackingTestApp::update()
 {
+    Logger::instance().setLevel( mLogLevel );
+    
+    Tracker::Params trackerParams = mTracker.getParams();
+    trackerParams.thresh = mThresh;
+    trackerParams.maxVal = mMaxVal;
+    trackerParams.nearLimit = mNearLimit;
+    trackerParams.farLimit = mFarLimit;
+    trackerParams.trackExpiryMs = mTrackExpiryMs;
+    trackerParams.floorSegmentation = mFloorSegmentation;
+    trackerParams.minHeight = mMinHeight;
+    trackerParams.floorMaxTilt = mFloorMaxTilt;
+    trackerParams.topDownGrid = mTopDownGrid;
+    trackerParams.splitArea = mSplitArea;
+    trackerParams.trackHeads = mTrackHeads;
+    trackerParams.motionThreshold = mMotionThreshold;
+    trackerParams.roiTracking = mRoiTracking;
+    trackerParams.opticalFlow = mOpticalFlow;
+    mTracker.setParams( trackerParams );
+    // shown read-only, set by the depth thread
+    mIdle = mTracker.isIdle();
+    Tracker::IdleStats idleStats = mTracker.getIdleStats();
+    mIdlePeriods = idleStats.idlePeriods;
+    mIdleSeconds = idleStats.idleMicros / 1.0e6f;
+    mSkippedFrames = (int32_t)idleStats.skippedFrames;
+    mWakeLatencyMs = idleStats.lastWakeLatencyMs;
+    mCandidatesPerTrack = mTracker.getCandidatesPerTrack();
+    mHeatmap.setHalfLife( mHeatmapHalfLife );
+    mHeatmap.setSnapshotInterval( mHeatmapSnapshotSeconds );
 }
 
 void MotionTrackingTestApp::draw()
 {
+    // upload textures and geometry once per published depth frame
+    cv::Mat depth, blur, subtract;
+    {
+        std::lock_guard<std::mutex> lock( mPublishMutex );
+        if( mUploadedFrameId != mPublishedFrameId ){
+            depth = mPublishedDepth;
+            blur = mPublishedBlur;
+            subtract = mPublishedSubtract;
+            std::swap( mGeometry, mPublishedGeometry );
+            mUploadedFrameId = mPublishedFrameId;
+            mGeometryVbo.bufferData( mGeometry.vertices.size() * sizeof( GLshort ), mGeometry.vertices.data(), GL_STREAM_DRAW );
+        }
+    }
+    uploadTexture( mTextureDepth, depth );
+    uploadTexture( mTextureBlur, blur );
+    uploadTexture( mTextureSubtract, subtract );
+    
+    uint32_t heatmapId;
+    cv::Mat heatmap = mHeatmap.getSnapshot( heatmapId );
+    if( heatmapId != mHeatmapId ){
+        uploadTexture( mTextureHeatmap, heatmap );
+        mHeatmapId = heatmapId;
+    }
+
    // gl::setViewport( getWindowBounds() );
     // clear out the window with black
 	gl::clear( Color( 1, 1, 1 ) );
@@ -280,52 +661,38 @@ void MotionTrackingTestApp::draw()
 //        gl::draw( mTexture, mTexture->getBounds(), getWindowBounds() );
 //    }
     
-    if( mSurfaceDepth ){
-        if( mTextureDepth ){
-            mTextureDepth->update( Channel32f( mSurfaceDepth ) );
-        } else {
-            mTextureDepth = gl::Texture::create( Channel32f( mSurfaceDepth ) );
-        }
-        gl::color( Color::white() );
+    gl::color( Color::white() );
+    if( mTextureDepth ){
         gl::draw( mTextureDepth, mTextureDepth->getBounds() );
     }
     gl::pushMatrices();
     gl::translate( Vec2f( 320, 0 ) );
-    if( mSurfaceBlur ){
-        if( mTextureDepth ){
-            mTextureDepth->update( Channel32f( mSurfaceBlur ) );
-        } else {
-            mTextureDepth = gl::Texture::create( Channel32f( mSurfaceBlur ) );
-        }
-        gl::draw( mTextureDepth, mTextureDepth->getBounds() );
+    if( mTextureBlur ){
+        gl::draw( mTextureBlur, mTextureBlur->getBounds() );
     }
     gl::translate( Vec2f( 0, 240 ) );
-    if( mSurfaceSubtract ){
-        if( mTextureDepth ){
-            mTextureDepth->update( Channel32f( mSurfaceSubtract ) );
-        } else {
-            mTextureDepth = gl::Texture::create( Channel32f( mSurfaceSubtract ) );
-        }
-        gl::draw( mTextureDepth, mTextureDepth->getBounds() );
+    if( mTextureSubtract ){
+        gl::draw( mTextureSubtract, mTextureSubtract->getBounds() );
     }
-    gl::translate( Vec2f( -320, 0 ) );
-    for( ContourVector::iterator iter = mContours.begin(); iter != mContours.end(); ++iter ){
-        glBegin( GL_LINE_LOOP );
-            for( vector< cv::Point >::iterator pt = iter->begin(); pt != iter->end(); ++pt ){
-                gl::color( Color( 1.0f, 0.0f, 0.0f ) );
-                gl::vertex( fromOcv( *pt ) );
-            }
-            glEnd();
+    gl::translate( Vec2f( 0, 240 ) );
+    if( mTextureHeatmap ){
+        gl::draw( mTextureHeatmap, Rectf( 0, 0, 320, 240 ) );
+    }
+    gl::translate( Vec2f( -320, -240 ) );
+    gl::color( Color( 1.0f, 0.0f, 0.0f ) );
+    mGeometryVbo.bind();
+    glEnableClientState( GL_VERTEX_ARRAY );
+    glVertexPointer( 2, GL_SHORT, 0, 0 );
+    if( ! mGeometry.loopCounts.empty() ){
+        glMultiDrawArrays( GL_LINE_LOOP, mGeometry.loopFirsts.data(), mGeometry.loopCounts.data(), mGeometry.loopCounts.size() );
     }
     gl::translate( Vec2f( 0, 240 ) );
-    for( int i=0; i<mTrackedShapes.size(); i++){
-        glBegin( GL_POINTS );
-        for( int j=0; j<mTrackedShapes[i].hull.size(); j++ ){
-           gl::color( Color( 1.0f, 0.0f, 0.0f ) );
-           gl::vertex( fromOcv( mTrackedShapes[i].hull[j] ) );
-        }
-        glEnd();
+    if( mGeometry.hullCount > 0 ){
+        glDrawArrays( GL_POINTS, mGeometry.hullFirst, mGeometry.hullCount );
     }
+    glDisableClientState( GL_VERTEX_ARRAY );
+    mGeometryVbo.unbind();
+    gl::color( Color::white() );
     gl::popMatrices();
     mParams->draw();
 }
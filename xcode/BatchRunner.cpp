@@ -0,0 +1,372 @@
+//
+//  BatchRunner.cpp
+//  MotionTrackingTest
+//
+
+#include "BatchRunner.h"
+#include "DepthRecording.h"
+#include "Logger.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+
+using namespace std;
+
+namespace {
+    // a track shorter than this is counted as flicker or a broken ID
+    const double SHORT_TRACK_SECONDS = 0.5;
+
+    // every Tracker::Params field a grid can sweep, in declaration order;
+    // the same table reads grid lines and writes the summary columns, so a
+    // parameter added here is both accepted and reported
+    struct ParamField {
+        const char* name;
+        double (*get)( const Tracker::Params &params );
+        void (*set)( Tracker::Params &params, double value );
+    };
+
+#define PARAM_FIELD( type, field ) { #field, \
+    []( const Tracker::Params &params ){ return (double)params.field; }, \
+    []( Tracker::Params &params, double value ){ params.field = (type)value; } }
+
+    const ParamField PARAM_FIELDS[] = {
+        PARAM_FIELD( double, thresh ),
+        PARAM_FIELD( double, maxVal ),
+        PARAM_FIELD( short, nearLimit ),
+        PARAM_FIELD( short, farLimit ),
+        PARAM_FIELD( int, minArea ),
+        PARAM_FIELD( int, maxArea ),
+        PARAM_FIELD( float, maxMatchDistance ),
+        PARAM_FIELD( float, maxMatchMetres ),
+        PARAM_FIELD( bool, floorSegmentation ),
+        PARAM_FIELD( float, minHeight ),
+        PARAM_FIELD( float, maxHeight ),
+        PARAM_FIELD( float, floorMaxTilt ),
+        PARAM_FIELD( bool, topDownGrid ),
+        PARAM_FIELD( float, gridCutHeight ),
+        PARAM_FIELD( int, splitArea ),
+        PARAM_FIELD( float, splitPeakRatio ),
+        PARAM_FIELD( bool, trackHeads ),
+        PARAM_FIELD( float, headBand ),
+        PARAM_FIELD( float, motionThreshold ),
+        PARAM_FIELD( int, motionRefreshFrames ),
+        PARAM_FIELD( int, idleAfterMs ),
+        PARAM_FIELD( int, idleCheckInterval ),
+        PARAM_FIELD( bool, roiTracking ),
+        PARAM_FIELD( int, fullScanInterval ),
+        PARAM_FIELD( int, roiMargin ),
+        PARAM_FIELD( bool, opticalFlow ),
+        PARAM_FIELD( bool, flowFromColor ),
+        PARAM_FIELD( bool, adaptiveGating ),
+        PARAM_FIELD( float, minGateMetres ),
+        PARAM_FIELD( float, gateGrowth ),
+        PARAM_FIELD( bool, reidentify ),
+        PARAM_FIELD( int, reidMaxAgeMs ),
+        PARAM_FIELD( float, reidMaxDistance ),
+        PARAM_FIELD( float, personThreshold ),
+        PARAM_FIELD( float, shapeWeight ),
+        PARAM_FIELD( int, trackExpiryMs )
+    };
+
+#undef PARAM_FIELD
+
+    bool setParam( Tracker::Params &params, const string &name, double value ){
+        for( const ParamField &field : PARAM_FIELDS ){
+            if( name == field.name ){
+                field.set( params, value );
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // summary column for a parameter, e.g. maxMatchMetres is max_match_metres
+    string columnName( const char* name ){
+        string column;
+        for( const char* c = name; *c; c++ ){
+            if( isupper( *c ) ){
+                column += '_';
+            }
+            column += (char)tolower( *c );
+        }
+        return column;
+    }
+
+    double seconds( chrono::steady_clock::time_point start ){
+        return chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+    }
+}
+
+BatchRunner::Result::Result() :
+recording(0),
+paramSet(0),
+ok(false),
+frames(0),
+seconds(0.0),
+tracks(0),
+meanTrackSeconds(0.0),
+shortTrackFraction(0.0),
+countAgreement(0.0),
+candidatesPerTrack(0.0f)
+{
+}
+
+BatchRunner::BatchRunner() :
+mOutputDirectory("batch"),
+mThreads(0),
+mWriteSamples(false),
+mNextRun(0)
+{
+    mParamSets.push_back( Tracker::Params() );
+}
+
+bool BatchRunner::loadRecordingList( const string &path ){
+    ifstream in( path.c_str() );
+    if( ! in ){
+        MT_LOG_ERROR( "batch: could not open recording list" );
+        return false;
+    }
+    string line;
+    while( getline( in, line ) ){
+        if( ! line.empty() && line[0] != '#' ){
+            mRecordings.push_back( line );
+        }
+    }
+    return ! mRecordings.empty();
+}
+
+bool BatchRunner::loadGrid( const string &path ){
+    ifstream in( path.c_str() );
+    if( ! in ){
+        MT_LOG_ERROR( "batch: could not open parameter grid" );
+        return false;
+    }
+    // every new axis multiplies the sets built so far
+    vector<Tracker::Params> sets( 1 );
+    string line;
+    while( getline( in, line ) ){
+        istringstream fields( line );
+        string name;
+        if( ! ( fields >> name ) || name[0] == '#' ){
+            continue;
+        }
+        vector<double> values;
+        double value;
+        while( fields >> value ){
+            values.push_back( value );
+        }
+        Tracker::Params probe;
+        if( values.empty() || ! setParam( probe, name, values[0] ) ){
+            MT_LOG_ERROR( "batch: bad parameter grid line" );
+            return false;
+        }
+        vector<Tracker::Params> expanded;
+        for( const Tracker::Params &base : sets ){
+            for( double v : values ){
+                Tracker::Params params = base;
+                setParam( params, name, v );
+                expanded.push_back( params );
+            }
+        }
+        sets.swap( expanded );
+    }
+    mParamSets = sets;
+    return true;
+}
+
+bool BatchRunner::run(){
+    mkdir( mOutputDirectory.c_str(), 0755 );
+
+    size_t runs = mRecordings.size() * mParamSets.size();
+    mResults.assign( runs, Result() );
+    mNextRun = 0;
+
+    int threads = mThreads > 0 ? mThreads : max( 1u, thread::hardware_concurrency() );
+    threads = min<size_t>( threads, max<size_t>( runs, 1 ) );
+    MT_LOG_INFO( "batch: recordings, parameter sets, threads", mRecordings.size(), mParamSets.size(), threads );
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for( int i = 0; i < threads; i++ ){
+        workers.push_back( thread( &BatchRunner::runWorker, this ) );
+    }
+    for( thread &worker : workers ){
+        worker.join();
+    }
+    double wallSeconds = seconds( start );
+
+    bool ok = writeSummary();
+    uint64_t frames = 0;
+    for( const Result &result : mResults ){
+        ok = ok && result.ok;
+        frames += result.frames;
+    }
+    printf( "batch: %zu runs, %llu frames in %.1f s (%.0f frames/s)\n", runs, (unsigned long long)frames, wallSeconds, wallSeconds > 0 ? frames / wallSeconds : 0.0 );
+    return ok;
+}
+
+// runs are handed out one at a time, so long recordings don't leave a thread
+// holding a queue of work while the others sit idle
+void BatchRunner::runWorker(){
+    for(;;){
+        size_t run = mNextRun++;
+        if( run >= mResults.size() ){
+            break;
+        }
+        mResults[run] = runOne( run / mParamSets.size(), run % mParamSets.size() );
+    }
+}
+
+BatchRunner::Result BatchRunner::runOne( size_t recording, size_t paramSet ){
+    Result result;
+    result.recording = recording;
+    result.paramSet = paramSet;
+
+    DepthRecordingMap input;
+    if( ! input.open( mRecordings[recording] ) ){
+        return result;
+    }
+    // the recording's own intrinsics, not whatever the grid assumed
+    Tracker::Params params = mParamSets[paramSet];
+    params.horizontalFov = input.getInfo().horizontalFov;
+    params.verticalFov = input.getInfo().verticalFov;
+
+    char name[64];
+    snprintf( name, sizeof( name ), "/run-%04zu-%04zu.csv", recording, paramSet );
+    FILE* tracks = fopen( ( mOutputDirectory + name ).c_str(), "w" );
+    if( tracks == NULL ){
+        MT_LOG_ERROR( "batch: could not open track file" );
+        return result;
+    }
+    fprintf( tracks, "timestamp,type,id,x,y,area,vx,vy,bx,by,bw,bh\n" );
+
+    Tracker tracker;
+    tracker.setParams( params );
+    if( ! mClassifierPath.empty() && ! tracker.loadClassifier( mClassifierPath ) ){
+        fclose( tracks );
+        return result;
+    }
+
+    // blob features of every matched track, for labelling and training
+    FILE* samples = NULL;
+    if( mWriteSamples ){
+        snprintf( name, sizeof( name ), "/samples-%04zu-%04zu.csv", recording, paramSet );
+        samples = fopen( ( mOutputDirectory + name ).c_str(), "w" );
+        if( samples == NULL ){
+            MT_LOG_ERROR( "batch: could not open sample file" );
+            fclose( tracks );
+            return result;
+        }
+        fprintf( samples, "%s\n", BlobClassifier::getFeatureNames() );
+    }
+
+    // first and last sighting of every track, and the live track count kept
+    // from the recorded decisions
+    map< int, pair<uint64_t, uint64_t> > spans;
+    set<int> recordedActive;
+    uint64_t agreeingFrames = 0;
+    vector<TrackEvent> recordedEvents;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for( size_t frame = 0; frame < input.getFrameCount(); frame++ ){
+        cv::Mat depth;
+        uint64_t timestamp = input.getTimestamp( frame );
+        if( ! input.readFrame( frame, depth, &recordedEvents ) ){
+            break;
+        }
+        tracker.process( depth, timestamp );
+
+        for( const TrackEvent &e : tracker.getEvents() ){
+            fprintf( tracks, "%llu,%d,%d,%.1f,%.1f,%.0f,%.1f,%.1f,%d,%d,%d,%d\n", (unsigned long long)timestamp, e.type, e.ID,
+                e.x, e.y, e.area, e.vx, e.vy, e.bx, e.by, e.bw, e.bh );
+            pair<uint64_t, uint64_t> &span = spans.insert( make_pair( e.ID, make_pair( timestamp, timestamp ) ) ).first->second;
+            span.second = timestamp;
+        }
+        for( const TrackEvent &e : recordedEvents ){
+            if( e.type == TrackEvent::EXIT ){
+                recordedActive.erase( e.ID );
+            } else {
+                recordedActive.insert( e.ID );
+            }
+        }
+        if( samples != NULL ){
+            float features[BlobClassifier::FEATURES];
+            for( const Shape &shape : tracker.getTrackedShapes() ){
+                if( shape.lastSeenTimestamp != timestamp ){
+                    continue;
+                }
+                BlobClassifier::describe( shape, features );
+                fprintf( samples, "%llu,%d,", (unsigned long long)timestamp, shape.ID );
+                for( int i = 0; i < BlobClassifier::FEATURES; i++ ){
+                    fprintf( samples, ",%g", features[i] );
+                }
+                fprintf( samples, "\n" );
+            }
+        }
+        if( recordedActive.size() == tracker.getTrackedShapes().size() ){
+            agreeingFrames++;
+        }
+        result.frames++;
+    }
+    result.seconds = seconds( start );
+    result.idle = tracker.getIdleStats();
+    result.candidatesPerTrack = tracker.getCandidatesPerTrack();
+    fclose( tracks );
+    if( samples != NULL ){
+        fclose( samples );
+    }
+
+    double totalSeconds = 0;
+    int shortTracks = 0;
+    for( const auto &span : spans ){
+        double s = ( span.second.second - span.second.first ) / 1.0e6;
+        totalSeconds += s;
+        if( s < SHORT_TRACK_SECONDS ){
+            shortTracks++;
+        }
+    }
+    result.tracks = spans.size();
+    if( result.tracks ){
+        result.meanTrackSeconds = totalSeconds / result.tracks;
+        result.shortTrackFraction = (double)shortTracks / result.tracks;
+    }
+    if( result.frames ){
+        result.countAgreement = (double)agreeingFrames / result.frames;
+    }
+    result.ok = true;
+    MT_LOG_INFO( "batch: finished recording, parameter set, frames", recording, paramSet, result.frames );
+    return result;
+}
+
+bool BatchRunner::writeSummary(){
+    FILE* out = fopen( ( mOutputDirectory + "/summary.csv" ).c_str(), "w" );
+    if( out == NULL ){
+        MT_LOG_ERROR( "batch: could not write summary" );
+        return false;
+    }
+    fprintf( out, "recording,param_set," );
+    for( const ParamField &field : PARAM_FIELDS ){
+        fprintf( out, "%s,", columnName( field.name ).c_str() );
+    }
+    fprintf( out, "ok,frames,seconds,fps,tracks,mean_track_s,short_track_fraction,count_agreement,idle_periods,idle_s,idle_skipped_frames,wake_latency_ms,candidates_per_track\n" );
+    for( const Result &r : mResults ){
+        const Tracker::Params &p = mParamSets[r.paramSet];
+        fprintf( out, "%s,%zu,", mRecordings[r.recording].c_str(), r.paramSet );
+        for( const ParamField &field : PARAM_FIELDS ){
+            fprintf( out, "%.9g,", field.get( p ) );
+        }
+        fprintf( out, "%d,%llu,%.3f,%.1f,%d,%.3f,%.3f,%.3f,%u,%.1f,%llu,%.1f,%.2f\n",
+            r.ok, (unsigned long long)r.frames, r.seconds, r.seconds > 0 ? r.frames / r.seconds : 0.0,
+            r.tracks, r.meanTrackSeconds, r.shortTrackFraction, r.countAgreement,
+            r.idle.idlePeriods, r.idle.idleMicros / 1.0e6, (unsigned long long)r.idle.skippedFrames, r.idle.lastWakeLatencyMs, r.candidatesPerTrack );
+    }
+    fclose( out );
+    return true;
+}
@@ -0,0 +1,82 @@
+//
+//  BatchRunner.h
+//  MotionTrackingTest
+//
+//  Offline parameter sweeps: every recording in a list is replayed through a
+//  fresh Tracker once per point of a parameter grid. Runs are independent and
+//  spread over a pool of worker threads, each writing its own track file;
+//  a summary of throughput and track statistics is written at the end.
+//
+//  The grid file has one parameter per line followed by its values, e.g.
+//      nearLimit 30 50
+//      minArea 75 150 300
+//  Names are those of the Tracker::Params fields, apart from the fields of
+//  view, which come from each recording; booleans take 0 or 1. Every one is
+//  also a column of the summary. Lines starting with # are ignored.
+//
+
+#pragma once
+#include "Tracker.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+class BatchRunner {
+public:
+    // per run results; recordings carry no ground truth, so accuracy is judged
+    // by proxies: short-lived tracks are flicker or broken IDs, and the live
+    // decisions stored in the recording give a reference track count
+    struct Result {
+        Result();
+
+        size_t recording;
+        size_t paramSet;
+        bool ok;
+        uint64_t frames;
+        double seconds;
+        int tracks;
+        double meanTrackSeconds;
+        double shortTrackFraction;
+        // fraction of frames whose active track count matches the recording
+        double countAgreement;
+        // idle mode, and matching cost as candidates checked per track
+        Tracker::IdleStats idle;
+        float candidatesPerTrack;
+    };
+
+    BatchRunner();
+
+    // one recording path per line
+    bool loadRecordingList( const std::string &path );
+    bool loadGrid( const std::string &path );
+    void setOutputDirectory( const std::string &directory ) { mOutputDirectory = directory; }
+    // 0 uses one thread per core
+    void setThreads( int threads ) { mThreads = threads; }
+    // model every run's tracker loads, see BlobClassifier
+    void setClassifier( const std::string &path ) { mClassifierPath = path; }
+    // also write samples-<recording>-<set>.csv with the classifier features
+    // of each matched track per frame, ready to be labelled
+    void setWriteSamples( bool write ) { mWriteSamples = write; }
+
+    // blocks until every run has finished; false if any run failed
+    bool run();
+
+    const std::vector<Tracker::Params>& getParamSets() const { return mParamSets; }
+    const std::vector<Result>& getResults() const { return mResults; }
+
+private:
+    void runWorker();
+    Result runOne( size_t recording, size_t paramSet );
+    bool writeSummary();
+
+    std::vector<std::string> mRecordings;
+    std::vector<Tracker::Params> mParamSets;
+    std::string mOutputDirectory;
+    int mThreads;
+    std::string mClassifierPath;
+    bool mWriteSamples;
+
+    std::vector<Result> mResults;
+    std::atomic<size_t> mNextRun;
+};
@@ -0,0 +1,113 @@
+//
+//  BlobClassifier.cpp
+//  MotionTrackingTest
+//
+
+#include "BlobClassifier.h"
+#include "Logger.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+namespace {
+    // leading columns of a sample file before the features
+    const int SAMPLE_COLUMNS = 3;
+}
+
+void BlobClassifier::describe( const Shape &shape, float* features ){
+    const cv::Rect &box = shape.boundingRect;
+    features[0] = (float)shape.area;
+    features[1] = box.height > 0 ? (float)box.width / box.height : 0.0f;
+    features[2] = box.area() > 0 ? (float)( shape.area / box.area() ) : 0.0f;
+    // the tracker's cached invariants; hu1 and hu2 are never negative, so
+    // log scaling with the small-value clamp keeps their order
+    features[3] = shape.hu[0];
+    features[4] = shape.hu[1];
+    features[5] = shape.depthDeviation;
+    features[6] = shape.height;
+    features[7] = shape.footprint;
+}
+
+const char* BlobClassifier::getFeatureNames(){
+    return "timestamp,id,label,area,aspect,fill,hu1,hu2,depth_deviation,height,footprint";
+}
+
+BlobClassifier::BlobClassifier() :
+mLoaded(false)
+{
+}
+
+bool BlobClassifier::load( const string &path ){
+    mForest.clear();
+    mForest.load( path.c_str() );
+    mLoaded = mForest.get_tree_count() > 0;
+    if( ! mLoaded ){
+        MT_LOG_ERROR( "classifier: could not load model" );
+    }
+    return mLoaded;
+}
+
+float BlobClassifier::score( const Shape &shape ) const {
+    if( ! mLoaded ){
+        return 1.0f;
+    }
+    float features[FEATURES];
+    describe( shape, features );
+    // a header over the stack array, nothing allocated per blob
+    return mForest.predict_prob( cv::Mat( 1, FEATURES, CV_32FC1, features ) );
+}
+
+bool BlobClassifier::train( const vector<string> &samplePaths, const string &modelPath ){
+    cv::Mat samples( 0, FEATURES, CV_32FC1 );
+    cv::Mat labels( 0, 1, CV_32SC1 );
+    int people = 0;
+    for( const string &path : samplePaths ){
+        ifstream in( path.c_str() );
+        if( ! in ){
+            MT_LOG_ERROR( "classifier: could not open sample file" );
+            return false;
+        }
+        string line;
+        getline( in, line );
+        while( getline( in, line ) ){
+            // timestamp,id,label,features...
+            vector<string> fields;
+            istringstream row( line );
+            string field;
+            while( getline( row, field, ',' ) ){
+                fields.push_back( field );
+            }
+            if( fields.size() != SAMPLE_COLUMNS + FEATURES || ( fields[2] != "0" && fields[2] != "1" ) ){
+                continue;
+            }
+            cv::Mat sample( 1, FEATURES, CV_32FC1 );
+            for( int i = 0; i < FEATURES; i++ ){
+                sample.at<float>( i ) = (float)atof( fields[SAMPLE_COLUMNS + i].c_str() );
+            }
+            int label = fields[2] == "1" ? 1 : 0;
+            samples.push_back( sample );
+            labels.push_back( label );
+            people += label;
+        }
+    }
+    if( people == 0 || people == samples.rows ){
+        MT_LOG_ERROR( "classifier: samples need both people and other blobs" );
+        return false;
+    }
+
+    cv::Mat varType( FEATURES + 1, 1, CV_8UC1, cv::Scalar( CV_VAR_ORDERED ) );
+    varType.at<uchar>( FEATURES ) = CV_VAR_CATEGORICAL;
+    // shallow trees keep scoring to microseconds
+    CvRTParams params( 8, 10, 0.0f, false, 2, NULL, false, 0, 32, 0.01f, CV_TERMCRIT_ITER );
+    CvRTrees forest;
+    if( ! forest.train( samples, CV_ROW_SAMPLE, labels, cv::Mat(), cv::Mat(), varType, cv::Mat(), params ) ){
+        MT_LOG_ERROR( "classifier: training failed" );
+        return false;
+    }
+    forest.save( modelPath.c_str() );
+    MT_LOG_INFO( "classifier: trained on samples, people, training error", samples.rows, people, forest.get_train_error() );
+    return true;
+}
@@ -0,0 +1,45 @@
+//
+//  BlobClassifier.h
+//  MotionTrackingTest
+//
+//  Small random forest that tells people from other blobs the size test
+//  lets through, like carts, chairs and reflections, so they are dropped
+//  before matching. Features are cheap ones already measured for every
+//  blob; scoring one is a few dozen tree lookups.
+//
+//  Trained offline from labelled samples: a batch run with sample output
+//  writes the features of every matched track per frame, with an empty
+//  label column to fill in with 1 for a person and 0 for anything else.
+//  Rows left unlabelled are skipped.
+//
+
+#pragma once
+#include "Shape.h"
+
+#include <string>
+#include <vector>
+
+class BlobClassifier {
+public:
+    // area, bounding box aspect and fill, two Hu invariants, depth spread,
+    // height and footprint
+    static const int FEATURES = 8;
+
+    static void describe( const Shape &shape, float* features );
+    // header for the sample files read by train
+    static const char* getFeatureNames();
+
+    BlobClassifier();
+
+    bool load( const std::string &path );
+    bool isLoaded() const { return mLoaded; }
+    // share of trees voting person, 1 when no model is loaded
+    float score( const Shape &shape ) const;
+
+    // trains on every labelled sample file and saves the model to path
+    static bool train( const std::vector<std::string> &samplePaths, const std::string &modelPath );
+
+private:
+    CvRTrees mForest;
+    bool mLoaded;
+};
@@ -0,0 +1,156 @@
+//
+//  DepthCodec.cpp
+//  MotionTrackingTest
+//
+
+#include "DepthCodec.h"
+
+#include <cstring>
+
+namespace {
+    class NibbleWriter {
+    public:
+        NibbleWriter( std::vector<uint8_t> &output, size_t expectedSize ) : mOutput( output ), mSize( output.size() ), mWord( 0 ), mNibbles( 0 ) {
+            mOutput.resize( mSize + expectedSize );
+        }
+
+        void encode( uint32_t value ){
+            do {
+                uint32_t nibble = value & 0x7;
+                value >>= 3;
+                if( value ){
+                    nibble |= 0x8;
+                }
+                mWord = ( mWord << 4 ) | nibble;
+                if( ++mNibbles == 8 ){
+                    flushWord();
+                }
+            } while( value );
+        }
+
+        void finish(){
+            if( mNibbles ){
+                mWord <<= 4 * ( 8 - mNibbles );
+                flushWord();
+            }
+            mOutput.resize( mSize );
+        }
+
+    private:
+        void flushWord(){
+            if( mSize + 4 > mOutput.size() ){
+                mOutput.resize( mOutput.size() * 2 + 64 );
+            }
+            memcpy( &mOutput[mSize], &mWord, 4 );
+            mSize += 4;
+            mWord = 0;
+            mNibbles = 0;
+        }
+
+        std::vector<uint8_t> &mOutput;
+        size_t mSize;
+        uint32_t mWord;
+        int mNibbles;
+    };
+
+    class NibbleReader {
+    public:
+        NibbleReader( const uint8_t* input, size_t size ) : mInput( input ), mEnd( input + size - size % 4 ), mWord( 0 ), mNibbles( 0 ), mOverrun( false ) {}
+
+        uint32_t decode(){
+            uint32_t value = 0;
+            int shift = 0;
+            for(;;){
+                if( mNibbles == 0 ){
+                    if( mInput == mEnd ){
+                        mOverrun = true;
+                        return 0;
+                    }
+                    memcpy( &mWord, mInput, 4 );
+                    mInput += 4;
+                    mNibbles = 8;
+                }
+                uint32_t nibble = mWord >> 28;
+                mWord <<= 4;
+                mNibbles--;
+                value |= ( nibble & 0x7 ) << shift;
+                if( ! ( nibble & 0x8 ) || shift > 27 ){
+                    break;
+                }
+                shift += 3;
+            }
+            return value;
+        }
+
+        bool overrun() const { return mOverrun; }
+
+    private:
+        const uint8_t* mInput;
+        const uint8_t* mEnd;
+        uint32_t mWord;
+        int mNibbles;
+        bool mOverrun;
+    };
+}
+
+size_t DepthCodec::compress( const uint16_t* input, int numPixels, std::vector<uint8_t> &output ){
+    size_t start = output.size();
+    // depth typically compresses to under a byte per pixel; grows if not
+    NibbleWriter writer( output, numPixels );
+
+    const uint16_t* end = input + numPixels;
+    int previous = 0;
+    while( input != end ){
+        uint32_t zeros = 0;
+        while( input != end && *input == 0 ){
+            input++;
+            zeros++;
+        }
+        writer.encode( zeros );
+
+        uint32_t nonzeros = 0;
+        for( const uint16_t* p = input; p != end && *p != 0; p++ ){
+            nonzeros++;
+        }
+        writer.encode( nonzeros );
+
+        for( uint32_t i = 0; i < nonzeros; i++ ){
+            int current = *input++;
+            int delta = current - previous;
+            writer.encode( ( delta << 1 ) ^ ( delta >> 31 ) );
+            previous = current;
+        }
+    }
+    writer.finish();
+    return output.size() - start;
+}
+
+bool DepthCodec::decompress( const uint8_t* input, size_t size, uint16_t* output, int numPixels ){
+    NibbleReader reader( input, size );
+    uint16_t* end = output + numPixels;
+    int previous = 0;
+    while( output != end ){
+        uint32_t zeros = reader.decode();
+        if( reader.overrun() || zeros > (uint32_t)( end - output ) ){
+            return false;
+        }
+        memset( output, 0, zeros * sizeof( uint16_t ) );
+        output += zeros;
+
+        uint32_t nonzeros = reader.decode();
+        if( reader.overrun() || nonzeros > (uint32_t)( end - output ) ){
+            return false;
+        }
+        for( uint32_t i = 0; i < nonzeros; i++ ){
+            uint32_t positive = reader.decode();
+            int delta = ( positive >> 1 ) ^ -(int)( positive & 1 );
+            int current = previous + delta;
+            *output++ = current;
+            previous = current;
+        }
+        if( reader.overrun() ){
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,22 @@
+//
+//  DepthCodec.h
+//  MotionTrackingTest
+//
+//  Lossless depth compression after Wilson's RVL: alternating runs of zero
+//  (invalid) and non-zero pixels, with the non-zero values stored as
+//  zig-zag deltas from the previous valid pixel. Run lengths and deltas are
+//  written as variable-length 3-bit nibbles packed into 32-bit words.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class DepthCodec {
+public:
+    // appends the encoded frame to output, returns the number of bytes added
+    static size_t compress( const uint16_t* input, int numPixels, std::vector<uint8_t> &output );
+    // false if the data runs out before numPixels have been decoded
+    static bool decompress( const uint8_t* input, size_t size, uint16_t* output, int numPixels );
+};
@@ -0,0 +1,93 @@
+//
+//  DepthProjector.cpp
+//  MotionTrackingTest
+//
+
+#include "DepthProjector.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace {
+    const float MILLIMETRES = 0.001f;
+}
+
+DepthProjector::DepthProjector() :
+mHorizontalFov(0.0f),
+mVerticalFov(0.0f),
+mFocalLength(0.0f),
+mPixelArea(0.0f)
+{
+}
+
+void DepthProjector::setup( int width, int height, float horizontalFov, float verticalFov ){
+    mHorizontalFov = horizontalFov;
+    mVerticalFov = verticalFov;
+
+    // pinhole focal lengths in pixels, principal point at the image centre
+    float fx = width * 0.5f / tanf( horizontalFov * 0.5f );
+    float fy = height * 0.5f / tanf( verticalFov * 0.5f );
+    mFocalLength = fx;
+    mPixelArea = 1.0f / ( fx * fy );
+
+    mRays.create( height, width, CV_32FC2 );
+    for( int y = 0; y < height; y++ ){
+        cv::Vec2f* ray = mRays.ptr<cv::Vec2f>( y );
+        float ry = ( height * 0.5f - ( y + 0.5f ) ) / fy;
+        for( int x = 0; x < width; x++ ){
+            ray[x] = cv::Vec2f( ( x + 0.5f - width * 0.5f ) / fx, ry );
+        }
+    }
+}
+
+bool DepthProjector::matches( int width, int height, float horizontalFov, float verticalFov ) const {
+    return mRays.cols == width && mRays.rows == height && mHorizontalFov == horizontalFov && mVerticalFov == verticalFov;
+}
+
+cv::Point3f DepthProjector::project( int x, int y, uint16_t depth ) const {
+    const cv::Vec2f &ray = mRays.at<cv::Vec2f>( y, x );
+    float z = depth * MILLIMETRES;
+    return cv::Point3f( ray[0] * z, ray[1] * z, z );
+}
+
+DepthProjector::Measurement DepthProjector::measure( const cv::Mat &depth, const cv::Rect &rect, const cv::Mat &mask, int nearLimit, int farLimit ) const {
+    Measurement result;
+    // sumArea is the sum of z squared, which also gives the depth spread
+    float sumX = 0.0f, sumY = 0.0f, sumZ = 0.0f, sumArea = 0.0f;
+    float minX = FLT_MAX, minY = FLT_MAX, minZ = FLT_MAX;
+    float maxX = -FLT_MAX, maxY = -FLT_MAX, maxZ = -FLT_MAX;
+
+    for( int y = 0; y < rect.height; y++ ){
+        const uint16_t* d = depth.ptr<uint16_t>( rect.y + y ) + rect.x;
+        const cv::Vec2f* ray = mRays.ptr<cv::Vec2f>( rect.y + y ) + rect.x;
+        const uint8_t* m = mask.ptr( y );
+        for( int x = 0; x < rect.width; x++ ){
+            if( m[x] == 0 || d[x] < nearLimit || d[x] > farLimit ){
+                continue;
+            }
+            float z = d[x] * MILLIMETRES;
+            float px = ray[x][0] * z;
+            float py = ray[x][1] * z;
+            sumX += px;
+            sumY += py;
+            sumZ += z;
+            sumArea += z * z;
+            minX = std::min( minX, px ); maxX = std::max( maxX, px );
+            minY = std::min( minY, py ); maxY = std::max( maxY, py );
+            minZ = std::min( minZ, z ); maxZ = std::max( maxZ, z );
+            result.pixels++;
+        }
+    }
+
+    if( result.pixels > 0 ){
+        float n = (float)result.pixels;
+        result.position = cv::Point3f( sumX / n, sumY / n, sumZ / n );
+        result.min = cv::Point3f( minX, minY, minZ );
+        result.max = cv::Point3f( maxX, maxY, maxZ );
+        result.footprint = sumArea * mPixelArea;
+        float meanZ = sumZ / n;
+        result.depthDeviation = sqrtf( std::max( sumArea / n - meanZ * meanZ, 0.0f ) );
+    }
+    return result;
+}
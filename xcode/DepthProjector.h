@@ -0,0 +1,57 @@
+//
+//  DepthProjector.h
+//  MotionTrackingTest
+//
+//  Turns depth pixels into metric camera-space points. A table holding the
+//  unit-depth ray through every pixel is built once from the sensor's fields
+//  of view, so projecting a pixel is one multiply of its ray by its depth.
+//
+//  Camera space is in metres: x right, y up, z away from the sensor.
+//
+
+#pragma once
+#include "opencv2/opencv.hpp"
+
+class DepthProjector {
+public:
+    // what measure() found inside a blob
+    struct Measurement {
+        Measurement() : pixels( 0 ), footprint( 0.0f ), depthDeviation( 0.0f ) {}
+
+        int pixels;
+        cv::Point3f position;
+        cv::Point3f min;
+        cv::Point3f max;
+        // visible surface facing the sensor, square metres
+        float footprint;
+        // standard deviation of depth, metres
+        float depthDeviation;
+    };
+
+    DepthProjector();
+
+    // fields of view in radians
+    void setup( int width, int height, float horizontalFov, float verticalFov );
+    bool isSetup() const { return ! mRays.empty(); }
+    bool matches( int width, int height, float horizontalFov, float verticalFov ) const;
+
+    // depth in millimetres, as delivered by the sensor
+    cv::Point3f project( int x, int y, uint16_t depth ) const;
+
+    // projects the pixels of rect that are set in mask (sized to rect) and
+    // have a depth within [nearLimit, farLimit]
+    Measurement measure( const cv::Mat &depth, const cv::Rect &rect, const cv::Mat &mask, int nearLimit, int farLimit ) const;
+
+    // x / z and y / z for every pixel
+    const cv::Mat& getRays() const { return mRays; }
+    // horizontal focal length, pixels spanned by a metre at a depth of one metre
+    float getFocalLength() const { return mFocalLength; }
+
+private:
+    cv::Mat mRays;
+    float mHorizontalFov;
+    float mVerticalFov;
+    float mFocalLength;
+    // area one pixel covers at a depth of one metre
+    float mPixelArea;
+};
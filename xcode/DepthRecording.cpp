@@ -0,0 +1,379 @@
+//
+//  DepthRecording.cpp
+//  MotionTrackingTest
+//
+
+#include "DepthRecording.h"
+#include "DepthCodec.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    const char MAGIC[4] = { 'M', 'T', 'D', 'R' };
+    const char INDEX_MAGIC[4] = { 'M', 'T', 'D', 'X' };
+    const uint32_t VERSION = 3;
+    const size_t HEADER_SIZE_V1 = 24;
+    const size_t HEADER_SIZE = 28;
+    const size_t FRAME_HEADER_SIZE = 16;
+    const size_t INDEX_ENTRY_SIZE = 16;
+    const size_t TRAILER_SIZE = 16;
+
+    template<typename T>
+    uint8_t* put( uint8_t* out, T value ){
+        memcpy( out, &value, sizeof( T ) );
+        return out + sizeof( T );
+    }
+
+    template<typename T>
+    const uint8_t* get( const uint8_t* in, T &value ){
+        memcpy( &value, in, sizeof( T ) );
+        return in + sizeof( T );
+    }
+
+    // parses the file header from the first size bytes, sets headerSize to the
+    // offset of the first frame
+    bool parseHeader( const uint8_t* header, size_t size, DepthRecordingInfo &info, uint32_t &version, size_t &headerSize ){
+        if( size < HEADER_SIZE_V1 || memcmp( header, MAGIC, 4 ) != 0 ){
+            MT_LOG_ERROR( "depth recording: not a depth recording" );
+            return false;
+        }
+        uint32_t width, height, compression;
+        const uint8_t* in = header + 4;
+        in = get( in, version );
+        in = get( in, width );
+        in = get( in, height );
+        in = get( in, info.horizontalFov );
+        in = get( in, info.verticalFov );
+        if( version == 1 ){
+            compression = DepthRecordingInfo::COMPRESSION_NONE;
+            headerSize = HEADER_SIZE_V1;
+        } else if( version <= VERSION && size >= HEADER_SIZE ){
+            in = get( in, compression );
+            headerSize = HEADER_SIZE;
+        } else {
+            MT_LOG_ERROR( "depth recording: unsupported version", version );
+            return false;
+        }
+        if( compression != DepthRecordingInfo::COMPRESSION_NONE && compression != DepthRecordingInfo::COMPRESSION_RVL ){
+            MT_LOG_ERROR( "depth recording: unsupported compression", compression );
+            return false;
+        }
+        info.compression = (DepthRecordingInfo::Compression)compression;
+        info.width = width;
+        info.height = height;
+        return true;
+    }
+
+    // raw payloads are always exactly one frame; encoded ones stay well below
+    // four times that
+    bool checkPayloadSize( const DepthRecordingInfo &info, uint32_t payloadSize ){
+        uint32_t rawSize = info.width * info.height * 2;
+        bool ok = info.compression == DepthRecordingInfo::COMPRESSION_NONE ? payloadSize == rawSize : payloadSize <= rawSize * 4;
+        if( ! ok ){
+            MT_LOG_ERROR( "depth recording: bad frame payload size", payloadSize );
+        }
+        return ok;
+    }
+
+    void decodeEvents( const uint8_t* in, uint32_t numEvents, std::vector<TrackEvent> &events ){
+        events.clear();
+        for( uint32_t i = 0; i < numEvents; i++ ){
+            TrackEvent e;
+            in = e.decode( in );
+            events.push_back( e );
+        }
+    }
+}
+
+// PrimeSense / Kinect depth camera defaults
+DepthRecordingInfo::DepthRecordingInfo() :
+width(0),
+height(0),
+horizontalFov(1.0144f),
+verticalFov(0.7898f),
+compression(COMPRESSION_RVL)
+{
+}
+
+DepthRecordingStats::DepthRecordingStats() :
+frames(0),
+rawBytes(0),
+encodedBytes(0),
+encodeSeconds(0.0)
+{
+}
+
+DepthRecordingWriter::DepthRecordingWriter() :
+mFile(NULL),
+mOffset(0)
+{
+}
+
+DepthRecordingWriter::~DepthRecordingWriter(){
+    close();
+}
+
+bool DepthRecordingWriter::open( const std::string &path, const DepthRecordingInfo &info ){
+    close();
+
+    mFile = fopen( path.c_str(), "wb" );
+    if( mFile == NULL ){
+        MT_LOG_ERROR( "depth recording: could not open file for writing" );
+        return false;
+    }
+    mInfo = info;
+    mStats = DepthRecordingStats();
+    mIndex.clear();
+
+    uint8_t header[HEADER_SIZE];
+    uint8_t* out = header;
+    memcpy( out, MAGIC, 4 );
+    out += 4;
+    out = put<uint32_t>( out, VERSION );
+    out = put<uint32_t>( out, info.width );
+    out = put<uint32_t>( out, info.height );
+    out = put<float>( out, info.horizontalFov );
+    out = put<float>( out, info.verticalFov );
+    out = put<uint32_t>( out, info.compression );
+    if( fwrite( header, 1, HEADER_SIZE, mFile ) != HEADER_SIZE ){
+        close();
+        return false;
+    }
+    mOffset = HEADER_SIZE;
+    return true;
+}
+
+void DepthRecordingWriter::close(){
+    if( mFile != NULL ){
+        if( mStats.frames ){
+            MT_LOG_INFO( "depth recording: frames, compression ratio, encode MB/s", mStats.frames, mStats.getRatio(), mStats.getEncodeMBps() );
+        }
+        writeIndex();
+        fclose( mFile );
+        mFile = NULL;
+    }
+}
+
+// frame offsets and timestamps go after the last frame, located through a
+// fixed-size trailer; a file cut short before this is indexed by walking its frames
+void DepthRecordingWriter::writeIndex(){
+    mBuffer.resize( mIndex.size() * INDEX_ENTRY_SIZE + TRAILER_SIZE );
+    uint8_t* out = mBuffer.data();
+    for( const IndexEntry &entry : mIndex ){
+        out = put<uint64_t>( out, entry.offset );
+        out = put<uint64_t>( out, entry.timestamp );
+    }
+    out = put<uint64_t>( out, mOffset );
+    out = put<uint32_t>( out, mIndex.size() );
+    memcpy( out, INDEX_MAGIC, 4 );
+    if( fwrite( mBuffer.data(), 1, mBuffer.size(), mFile ) != mBuffer.size() ){
+        MT_LOG_ERROR( "depth recording: could not write frame index" );
+    }
+}
+
+bool DepthRecordingWriter::writeFrame( uint64_t timestamp, const cv::Mat &depth, const TrackEvent* events, size_t numEvents ){
+    if( mFile == NULL || depth.cols != mInfo.width || depth.rows != mInfo.height || depth.elemSize() != 2 ){
+        return false;
+    }
+
+    uint32_t rawSize = mInfo.width * mInfo.height * 2;
+    uint32_t payloadSize = rawSize;
+    mBuffer.resize( FRAME_HEADER_SIZE );
+
+    if( mInfo.compression == DepthRecordingInfo::COMPRESSION_RVL ){
+        const uint16_t* pixels = (const uint16_t*)depth.data;
+        if( ! depth.isContinuous() ){
+            mRows.resize( mInfo.width * mInfo.height );
+            for( int y = 0; y < depth.rows; y++ ){
+                memcpy( &mRows[y * depth.cols], depth.ptr( y ), depth.cols * 2 );
+            }
+            pixels = mRows.data();
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        payloadSize = DepthCodec::compress( pixels, mInfo.width * mInfo.height, mBuffer );
+        mStats.encodeSeconds += std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    }
+
+    size_t eventsOffset = mBuffer.size();
+    mBuffer.resize( eventsOffset + numEvents * TrackEvent::ENCODED_SIZE );
+    uint8_t* out = mBuffer.data();
+    out = put<uint64_t>( out, timestamp );
+    out = put<uint32_t>( out, payloadSize );
+    out = put<uint32_t>( out, numEvents );
+    out = mBuffer.data() + eventsOffset;
+    for( size_t i = 0; i < numEvents; i++ ){
+        out = events[i].encode( out );
+    }
+
+    bool ok;
+    if( mInfo.compression == DepthRecordingInfo::COMPRESSION_RVL ){
+        ok = fwrite( mBuffer.data(), 1, mBuffer.size(), mFile ) == mBuffer.size();
+    } else {
+        ok = fwrite( mBuffer.data(), 1, FRAME_HEADER_SIZE, mFile ) == FRAME_HEADER_SIZE;
+        for( int y = 0; ok && y < depth.rows; y++ ){
+            ok = fwrite( depth.ptr( y ), 2, depth.cols, mFile ) == (size_t)depth.cols;
+        }
+        size_t eventBytes = mBuffer.size() - eventsOffset;
+        ok = ok && fwrite( mBuffer.data() + eventsOffset, 1, eventBytes, mFile ) == eventBytes;
+    }
+
+    if( ok ){
+        IndexEntry entry = { mOffset, timestamp };
+        mIndex.push_back( entry );
+        mOffset += FRAME_HEADER_SIZE + payloadSize + numEvents * TrackEvent::ENCODED_SIZE;
+        mStats.frames++;
+        mStats.rawBytes += rawSize;
+        mStats.encodedBytes += payloadSize;
+    }
+    return ok;
+}
+
+DepthRecordingMap::DepthRecordingMap() :
+mData(NULL),
+mSize(0)
+{
+}
+
+DepthRecordingMap::~DepthRecordingMap(){
+    close();
+}
+
+bool DepthRecordingMap::open( const std::string &path ){
+    close();
+
+    int fd = ::open( path.c_str(), O_RDONLY );
+    if( fd < 0 ){
+        MT_LOG_ERROR( "depth recording: could not open file for reading" );
+        return false;
+    }
+    struct stat st;
+    if( fstat( fd, &st ) != 0 || st.st_size == 0 || (uint64_t)st.st_size > SIZE_MAX ){
+        MT_LOG_ERROR( "depth recording: file is empty or too large to map" );
+        ::close( fd );
+        return false;
+    }
+    void* data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    // the mapping keeps the file open on its own
+    ::close( fd );
+    if( data == MAP_FAILED ){
+        MT_LOG_ERROR( "depth recording: could not map file" );
+        return false;
+    }
+    mData = (const uint8_t*)data;
+    mSize = st.st_size;
+
+    uint32_t version;
+    size_t headerSize;
+    if( ! parseHeader( mData, mSize, mInfo, version, headerSize ) ){
+        close();
+        return false;
+    }
+    if( version < 3 || ! readIndex( headerSize ) ){
+        buildIndex( headerSize );
+    }
+    return true;
+}
+
+void DepthRecordingMap::close(){
+    if( mData != NULL ){
+        munmap( (void*)mData, mSize );
+        mData = NULL;
+        mSize = 0;
+    }
+    mIndex.clear();
+}
+
+bool DepthRecordingMap::readIndex( size_t headerSize ){
+    if( mSize < headerSize + TRAILER_SIZE ){
+        return false;
+    }
+    const uint8_t* trailer = mData + mSize - TRAILER_SIZE;
+    if( memcmp( trailer + 12, INDEX_MAGIC, 4 ) != 0 ){
+        return false;
+    }
+    uint64_t indexOffset;
+    uint32_t count;
+    get( get( trailer, indexOffset ), count );
+    if( indexOffset < headerSize || indexOffset + (uint64_t)count * INDEX_ENTRY_SIZE + TRAILER_SIZE != mSize ){
+        return false;
+    }
+
+    mIndex.resize( count );
+    const uint8_t* in = mData + indexOffset;
+    for( uint32_t i = 0; i < count; i++ ){
+        in = get( in, mIndex[i].offset );
+        in = get( in, mIndex[i].timestamp );
+        if( mIndex[i].offset + FRAME_HEADER_SIZE > indexOffset ){
+            mIndex.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+// older files and captures that never closed cleanly have no index; walk the
+// frame headers once instead
+void DepthRecordingMap::buildIndex( size_t headerSize ){
+    mIndex.clear();
+    uint64_t offset = headerSize;
+    while( offset + FRAME_HEADER_SIZE <= mSize ){
+        IndexEntry entry;
+        uint32_t payloadSize, numEvents;
+        const uint8_t* in = mData + offset;
+        in = get( in, entry.timestamp );
+        in = get( in, payloadSize );
+        in = get( in, numEvents );
+        uint64_t frameSize = FRAME_HEADER_SIZE + (uint64_t)payloadSize + (uint64_t)numEvents * TrackEvent::ENCODED_SIZE;
+        if( ! checkPayloadSize( mInfo, payloadSize ) || offset + frameSize > mSize ){
+            break;
+        }
+        entry.offset = offset;
+        mIndex.push_back( entry );
+        offset += frameSize;
+    }
+}
+
+size_t DepthRecordingMap::findFrame( uint64_t timestamp ) const {
+    if( mIndex.empty() ){
+        return 0;
+    }
+    std::vector<IndexEntry>::const_iterator it = std::lower_bound( mIndex.begin(), mIndex.end(), timestamp,
+        []( const IndexEntry &entry, uint64_t t ){ return entry.timestamp < t; } );
+    return std::min<size_t>( it - mIndex.begin(), mIndex.size() - 1 );
+}
+
+bool DepthRecordingMap::readFrame( size_t frame, cv::Mat &depth, std::vector<TrackEvent>* events ) const {
+    if( frame >= mIndex.size() ){
+        return false;
+    }
+    uint64_t timestamp;
+    uint32_t payloadSize, numEvents;
+    const uint8_t* in = mData + mIndex[frame].offset;
+    in = get( in, timestamp );
+    in = get( in, payloadSize );
+    in = get( in, numEvents );
+    if( ! checkPayloadSize( mInfo, payloadSize ) || mIndex[frame].offset + FRAME_HEADER_SIZE + payloadSize + (uint64_t)numEvents * TrackEvent::ENCODED_SIZE > mSize ){
+        return false;
+    }
+
+    if( mInfo.compression == DepthRecordingInfo::COMPRESSION_NONE ){
+        depth = cv::Mat( mInfo.height, mInfo.width, CV_16UC1, (void*)in );
+    } else {
+        depth.create( mInfo.height, mInfo.width, CV_16UC1 );
+        if( ! DepthCodec::decompress( in, payloadSize, (uint16_t*)depth.data, mInfo.width * mInfo.height ) ){
+            MT_LOG_ERROR( "depth recording: corrupt compressed frame" );
+            return false;
+        }
+    }
+    if( events != NULL ){
+        decodeEvents( in + payloadSize, numEvents, *events );
+    }
+    return true;
+}
@@ -0,0 +1,118 @@
+//
+//  DepthRecording.h
+//  MotionTrackingTest
+//
+//  Depth recording files (.mtdr) for replaying the tracker offline, read
+//  through a memory map with random access by frame.
+//
+//  Layout, little-endian:
+//    header  magic "MTDR", u32 version, u32 width, u32 height,
+//            f32 horizontal / vertical field of view (radians),
+//            u32 compression (version 2 onwards)
+//    frame   u64 sensor timestamp (us), u32 payload bytes, u32 event count,
+//            payload (width * height u16 depth, raw or DepthCodec encoded),
+//            events (TrackEvent encoding)
+//    index   per frame u64 file offset, u64 timestamp (version 3 onwards)
+//    trailer u64 index offset, u32 frame count, magic "MTDX"
+//
+//  Version 1 files have no compression field and always carry raw payloads.
+//  Files without a valid trailer are indexed by walking the frame headers.
+//
+
+#pragma once
+#include "TrackEvents.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct DepthRecordingInfo {
+    enum Compression { COMPRESSION_NONE = 0, COMPRESSION_RVL = 1 };
+
+    DepthRecordingInfo();
+
+    int width;
+    int height;
+    float horizontalFov;
+    float verticalFov;
+    Compression compression;
+};
+
+// running totals for a writer, enough to judge ratio and encoder throughput
+struct DepthRecordingStats {
+    DepthRecordingStats();
+
+    double getRatio() const { return encodedBytes ? (double)rawBytes / encodedBytes : 0.0; }
+    double getEncodeMBps() const { return encodeSeconds > 0 ? rawBytes / encodeSeconds / 1.0e6 : 0.0; }
+
+    uint64_t frames;
+    uint64_t rawBytes;
+    uint64_t encodedBytes;
+    double encodeSeconds;
+};
+
+class DepthRecordingWriter {
+public:
+    DepthRecordingWriter();
+    ~DepthRecordingWriter();
+
+    bool open( const std::string &path, const DepthRecordingInfo &info );
+    void close();
+    bool isOpen() const { return mFile != NULL; }
+
+    bool writeFrame( uint64_t timestamp, const cv::Mat &depth, const TrackEvent* events, size_t numEvents );
+
+    const DepthRecordingStats& getStats() const { return mStats; }
+
+private:
+    struct IndexEntry {
+        uint64_t offset;
+        uint64_t timestamp;
+    };
+
+    void writeIndex();
+
+    FILE* mFile;
+    uint64_t mOffset;
+    std::vector<IndexEntry> mIndex;
+    DepthRecordingInfo mInfo;
+    DepthRecordingStats mStats;
+    std::vector<uint8_t> mBuffer;
+    std::vector<uint16_t> mRows;
+};
+
+// Maps the whole file read-only, so opening costs only the index. Frames are
+// decoded on demand; raw frames come back as a Mat header over the mapping
+// itself, which must not be written to and is valid only while the map is open.
+class DepthRecordingMap {
+public:
+    DepthRecordingMap();
+    ~DepthRecordingMap();
+
+    bool open( const std::string &path );
+    void close();
+    bool isOpen() const { return mData != NULL; }
+    const DepthRecordingInfo& getInfo() const { return mInfo; }
+
+    size_t getFrameCount() const { return mIndex.size(); }
+    uint64_t getTimestamp( size_t frame ) const { return mIndex[frame].timestamp; }
+    // first frame at or after timestamp, clamped to the last frame
+    size_t findFrame( uint64_t timestamp ) const;
+
+    // safe to call from several threads at once with different Mats
+    bool readFrame( size_t frame, cv::Mat &depth, std::vector<TrackEvent>* events = NULL ) const;
+
+private:
+    struct IndexEntry {
+        uint64_t offset;
+        uint64_t timestamp;
+    };
+
+    bool readIndex( size_t headerSize );
+    void buildIndex( size_t headerSize );
+
+    const uint8_t* mData;
+    size_t mSize;
+    DepthRecordingInfo mInfo;
+    std::vector<IndexEntry> mIndex;
+};
@@ -0,0 +1,125 @@
+//
+//  FlightRecorder.cpp
+//  MotionTrackingTest
+//
+
+#include "FlightRecorder.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+
+FlightRecorder::FlightRecorder() :
+mCapacity(0),
+mHead(0),
+mCount(0),
+mFrameSize(0),
+mDumping(false),
+mReason(""),
+mRunning(true),
+mDumpRequested(false)
+{
+    mThread = std::thread( &FlightRecorder::run, this );
+}
+
+FlightRecorder::~FlightRecorder(){
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mRunning = false;
+    }
+    mCondition.notify_one();
+    mThread.join();
+}
+
+void FlightRecorder::setup( int capacityFrames, const DepthRecordingInfo &info, const std::string &directory ){
+    mCapacity = capacityFrames;
+    mInfo = info;
+    mDirectory = directory;
+    mFrameSize = info.width * info.height;
+    mHead = 0;
+    mCount = 0;
+    mDepth.assign( mFrameSize * mCapacity, 0 );
+    mSlots.resize( mCapacity );
+}
+
+void FlightRecorder::record( uint64_t timestamp, const cv::Mat &depth, const std::vector<TrackEvent> &events ){
+    if( mCapacity == 0 || mDumping.load( std::memory_order_acquire ) ){
+        return;
+    }
+    if( depth.cols != mInfo.width || depth.rows != mInfo.height || depth.elemSize() != 2 ){
+        return;
+    }
+
+    uint16_t* out = &mDepth[mHead * mFrameSize];
+    for( int y = 0; y < depth.rows; y++ ){
+        memcpy( out + y * depth.cols, depth.ptr( y ), depth.cols * 2 );
+    }
+
+    Slot &slot = mSlots[mHead];
+    slot.timestamp = timestamp;
+    slot.numEvents = std::min( (int)events.size(), (int)MAX_EVENTS_PER_FRAME );
+    std::copy( events.begin(), events.begin() + slot.numEvents, slot.events );
+
+    mHead = ( mHead + 1 ) % mCapacity;
+    mCount = std::min( mCount + 1, mCapacity );
+}
+
+void FlightRecorder::trigger( const char* reason ){
+    if( mCapacity == 0 || mDumping.exchange( true, std::memory_order_acq_rel ) ){
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mReason = reason;
+        mDumpRequested = true;
+    }
+    mCondition.notify_one();
+}
+
+void FlightRecorder::run(){
+    std::unique_lock<std::mutex> lock( mMutex );
+    for(;;){
+        mCondition.wait( lock, [this]{ return mDumpRequested || ! mRunning; } );
+        if( ! mDumpRequested ){
+            break;
+        }
+        mDumpRequested = false;
+        lock.unlock();
+        dump();
+        // recording resumes into an empty ring once it has been written out
+        mHead = 0;
+        mCount = 0;
+        mDumping.store( false, std::memory_order_release );
+        lock.lock();
+    }
+}
+
+void FlightRecorder::dump(){
+    char name[64];
+    time_t now = time( NULL );
+    strftime( name, sizeof( name ), "flight-%Y%m%d-%H%M%S.mtdr", localtime( &now ) );
+    std::string path = mDirectory.empty() ? name : mDirectory + "/" + name;
+
+    DepthRecordingWriter writer;
+    if( ! writer.open( path, mInfo ) ){
+        return;
+    }
+
+    MT_LOG_INFO( mReason );
+    MT_LOG_INFO( "flight recorder: dumping frames", mCount );
+
+    // oldest first
+    int first = ( mHead - mCount + mCapacity ) % mCapacity;
+    for( int i = 0; i < mCount; i++ ){
+        int index = ( first + i ) % mCapacity;
+        const Slot &slot = mSlots[index];
+        cv::Mat depth( mInfo.height, mInfo.width, CV_16UC1, &mDepth[index * mFrameSize] );
+        if( ! writer.writeFrame( slot.timestamp, depth, slot.events, slot.numEvents ) ){
+            MT_LOG_ERROR( "flight recorder: write failed at frame", i );
+            break;
+        }
+    }
+    writer.close();
+    MT_LOG_INFO( "flight recorder: dump complete" );
+}
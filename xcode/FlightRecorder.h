@@ -0,0 +1,68 @@
+//
+//  FlightRecorder.h
+//  MotionTrackingTest
+//
+//  Keeps the last few seconds of depth frames and tracker decisions in a
+//  preallocated ring. Recording copies into the ring without allocating;
+//  a trigger hands the ring to a background thread that dumps it to a
+//  depth recording, which replays through the normal tracker.
+//
+
+#pragma once
+#include "DepthRecording.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+class FlightRecorder {
+public:
+    // decisions beyond this many per frame are not kept
+    static const int MAX_EVENTS_PER_FRAME = 64;
+
+    FlightRecorder();
+    ~FlightRecorder();
+
+    // allocates the whole ring up front
+    void setup( int capacityFrames, const DepthRecordingInfo &info, const std::string &directory );
+
+    // called from the depth thread; frames arriving while a dump is in progress
+    // are skipped, and the ring starts empty again afterwards
+    void record( uint64_t timestamp, const cv::Mat &depth, const std::vector<TrackEvent> &events );
+
+    // starts an asynchronous dump unless one is already running; call from the
+    // same thread as record() so the ring is never written while it is read
+    void trigger( const char* reason );
+    bool isDumping() const { return mDumping.load( std::memory_order_acquire ); }
+
+    int getCapacity() const { return mCapacity; }
+    int getFrameCount() const { return mCount; }
+
+private:
+    struct Slot {
+        uint64_t timestamp;
+        int numEvents;
+        TrackEvent events[MAX_EVENTS_PER_FRAME];
+    };
+
+    void run();
+    void dump();
+
+    int mCapacity;
+    int mHead;
+    int mCount;
+    size_t mFrameSize;
+    DepthRecordingInfo mInfo;
+    std::string mDirectory;
+    std::vector<uint16_t> mDepth;
+    std::vector<Slot> mSlots;
+
+    std::atomic<bool> mDumping;
+    const char* mReason;
+    bool mRunning;
+    bool mDumpRequested;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::thread mThread;
+};
@@ -0,0 +1,212 @@
+//
+//  FloorPlane.cpp
+//  MotionTrackingTest
+//
+
+#include "FloorPlane.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <cmath>
+
+FloorPlane::Params::Params() :
+sampleStep(8),
+iterations(200),
+inlierDistance(0.03f),
+minInlierFraction(0.2f),
+maxTilt(60.0f),
+checkInterval(30)
+{
+}
+
+FloorPlane::FloorPlane( const Params &params ) :
+mParams(params),
+mRng(0x464c4f52),
+mRevision(0)
+{
+    reset();
+}
+
+void FloorPlane::reset(){
+    mValid = false;
+    mNormal = cv::Vec3f( 0.0f, 1.0f, 0.0f );
+    mOffset = 0.0f;
+    mInlierFraction = 0.0f;
+    mFramesToCheck = 0;
+    mMissingLogged = false;
+}
+
+void FloorPlane::update( const cv::Mat &depth, const DepthProjector &projector, int nearLimit, int farLimit ){
+    if( --mFramesToCheck > 0 ){
+        return;
+    }
+    mFramesToCheck = mParams.checkInterval;
+    sample( depth, projector, nearLimit, farLimit );
+
+    if( mValid ){
+        // most of the sample still on the plane: follow it, otherwise search again
+        float fraction = refine();
+        if( fraction >= std::max( mParams.minInlierFraction, mInlierFraction * 0.5f ) ){
+            mInlierFraction = fraction;
+            buildTable( projector );
+            return;
+        }
+        MT_LOG_INFO( "floor: plane drifted, inlier fraction", fraction );
+        mValid = false;
+    }
+
+    int steep = 0;
+    if( fitRansac( steep ) ){
+        mInlierFraction = refine();
+        mValid = true;
+        mMissingLogged = false;
+        buildTable( projector );
+        float pitch = acosf( std::max( std::min( mNormal[1], 1.0f ), -1.0f ) ) * 180.0f / (float)CV_PI;
+        MT_LOG_INFO( "floor: plane found, camera height m, pitch deg, inlier fraction", mOffset, pitch, mInlierFraction );
+    } else if( ! mMissingLogged ){
+        // without a floor, height segmentation and the grid stay off
+        MT_LOG_WARN( "floor: no acceptable plane, samples, hypotheses steeper than max tilt, max tilt deg", mSamples.size(), steep, mParams.maxTilt );
+        mMissingLogged = true;
+    }
+}
+
+void FloorPlane::sample( const cv::Mat &depth, const DepthProjector &projector, int nearLimit, int farLimit ){
+    mSamples.clear();
+    int step = std::max( mParams.sampleStep, 1 );
+    for( int y = step / 2; y < depth.rows; y += step ){
+        const uint16_t* d = depth.ptr<uint16_t>( y );
+        for( int x = step / 2; x < depth.cols; x += step ){
+            if( d[x] >= nearLimit && d[x] <= farLimit ){
+                mSamples.push_back( projector.project( x, y, d[x] ) );
+            }
+        }
+    }
+}
+
+bool FloorPlane::fitRansac( int &steep ){
+    steep = 0;
+    int count = (int)mSamples.size();
+    if( count < 3 ){
+        return false;
+    }
+    float minUp = cosf( mParams.maxTilt * (float)CV_PI / 180.0f );
+    int bestInliers = 0;
+    cv::Vec3f bestNormal;
+    float bestOffset = 0.0f;
+
+    for( int i = 0; i < mParams.iterations; i++ ){
+        const cv::Point3f &a = mSamples[mRng.uniform( 0, count )];
+        const cv::Point3f &b = mSamples[mRng.uniform( 0, count )];
+        const cv::Point3f &c = mSamples[mRng.uniform( 0, count )];
+        cv::Point3f cross = ( b - a ).cross( c - a );
+        float length = sqrtf( cross.dot( cross ) );
+        if( length < 1.0e-6f ){
+            continue;
+        }
+        cv::Vec3f normal( cross.x / length, cross.y / length, cross.z / length );
+        float offset = -( normal[0] * a.x + normal[1] * a.y + normal[2] * a.z );
+        // the camera is above the floor, so the normal points to its side;
+        // going by the camera's up axis instead would flip a plane seen from
+        // straight above at random
+        if( offset < 0.0f ){
+            normal = -normal;
+            offset = -offset;
+        }
+        if( offset < 1.0e-3f ){
+            continue;
+        }
+        // walls and ceilings are not floors
+        if( normal[1] < minUp ){
+            steep++;
+            continue;
+        }
+
+        int inliers = 0;
+        for( const cv::Point3f &p : mSamples ){
+            if( fabsf( normal[0] * p.x + normal[1] * p.y + normal[2] * p.z + offset ) < mParams.inlierDistance ){
+                inliers++;
+            }
+        }
+        if( inliers > bestInliers ){
+            bestInliers = inliers;
+            bestNormal = normal;
+            bestOffset = offset;
+        }
+    }
+
+    if( bestInliers < mParams.minInlierFraction * count ){
+        return false;
+    }
+    mNormal = bestNormal;
+    mOffset = bestOffset;
+    return true;
+}
+
+float FloorPlane::refine(){
+    if( mSamples.empty() ){
+        return 0.0f;
+    }
+    // centroid and scatter of the points on the current plane
+    cv::Point3f sum;
+    std::vector<cv::Point3f> inliers;
+    for( const cv::Point3f &p : mSamples ){
+        if( fabsf( mNormal[0] * p.x + mNormal[1] * p.y + mNormal[2] * p.z + mOffset ) < mParams.inlierDistance ){
+            inliers.push_back( p );
+            sum += p;
+        }
+    }
+    float fraction = (float)inliers.size() / mSamples.size();
+    if( inliers.size() < 3 ){
+        return fraction;
+    }
+    cv::Point3f centroid = sum * ( 1.0f / inliers.size() );
+    cv::Matx33f scatter = cv::Matx33f::zeros();
+    for( const cv::Point3f &p : inliers ){
+        cv::Vec3f v( p.x - centroid.x, p.y - centroid.y, p.z - centroid.z );
+        scatter += v * v.t();
+    }
+
+    // the normal is the direction of least spread
+    cv::Mat values, vectors;
+    cv::eigen( cv::Mat( scatter ), values, vectors );
+    cv::Vec3f normal( vectors.at<float>( 2, 0 ), vectors.at<float>( 2, 1 ), vectors.at<float>( 2, 2 ) );
+    float offset = -( normal[0] * centroid.x + normal[1] * centroid.y + normal[2] * centroid.z );
+    if( offset < 0.0f ){
+        normal = -normal;
+        offset = -offset;
+    }
+    if( offset > 0.0f ){
+        mNormal = normal;
+        mOffset = offset;
+    }
+    return fraction;
+}
+
+void FloorPlane::buildTable( const DepthProjector &projector ){
+    const cv::Mat &rays = projector.getRays();
+    mHeightScale.create( rays.rows, rays.cols, CV_32FC1 );
+    for( int y = 0; y < rays.rows; y++ ){
+        const cv::Vec2f* ray = rays.ptr<cv::Vec2f>( y );
+        float* scale = mHeightScale.ptr<float>( y );
+        for( int x = 0; x < rays.cols; x++ ){
+            scale[x] = mNormal[0] * ray[x][0] + mNormal[1] * ray[x][1] + mNormal[2];
+        }
+    }
+    mRevision++;
+}
+
+void FloorPlane::segment( const cv::Mat &depth, const cv::Rect &rect, int nearLimit, int farLimit, float minHeight, float maxHeight, cv::Mat &mask ) const {
+    mask.create( depth.rows, depth.cols, CV_8UC1 );
+    // depth and heights in millimetres
+    float offset = mOffset * 1000.0f;
+    for( int y = rect.y; y < rect.y + rect.height; y++ ){
+        const uint16_t* d = depth.ptr<uint16_t>( y );
+        const float* scale = mHeightScale.ptr<float>( y );
+        uint8_t* out = mask.ptr( y );
+        for( int x = rect.x; x < rect.x + rect.width; x++ ){
+            float height = d[x] * scale[x] + offset;
+            bool usable = d[x] >= nearLimit && d[x] <= farLimit;
+            out[x] = usable && height >= minHeight && height <= maxHeight ? 255 : 0;
+        }
+    }
+}
@@ -0,0 +1,87 @@
+//
+//  FloorPlane.h
+//  MotionTrackingTest
+//
+//  Finds the floor in the depth image so shapes can be segmented by height
+//  above it rather than by a fixed depth slab, which suits an angled sensor.
+//
+//  The plane is fitted with RANSAC over a sparse grid of sampled points and
+//  refined by least squares. Every so often a fresh sample is checked against
+//  it: while most of it still lies on the plane the fit is only refined, and
+//  RANSAC is re-run when it does not. Each fit precomputes, for every pixel,
+//  the factor turning its depth into height above the floor, so segmentation
+//  costs one multiply-add and a compare per pixel.
+//
+
+#pragma once
+#include "DepthProjector.h"
+
+#include <vector>
+
+class FloorPlane {
+public:
+    struct Params {
+        Params();
+
+        // sample every step-th pixel in both directions
+        int sampleStep;
+        int iterations;
+        // points this close to the plane count as on it, metres
+        float inlierDistance;
+        // a fit needs this fraction of valid samples on the plane
+        float minInlierFraction;
+        // steepest floor accepted, degrees between its normal and the
+        // camera's up axis; over 90 accepts a sensor looking straight down
+        float maxTilt;
+        // frames between drift checks
+        int checkInterval;
+    };
+
+    explicit FloorPlane( const Params &params = Params() );
+
+    // takes effect at the next fit
+    void setParams( const Params &params ) { mParams = params; }
+    const Params& getParams() const { return mParams; }
+
+    void reset();
+    // fits or checks the plane when due; depth in millimetres
+    void update( const cv::Mat &depth, const DepthProjector &projector, int nearLimit, int farLimit );
+    bool isValid() const { return mValid; }
+
+    // unit normal pointing to the camera's side, and height of the camera
+    // above the floor
+    const cv::Vec3f& getNormal() const { return mNormal; }
+    float getCameraHeight() const { return mOffset; }
+    // bumped whenever the plane moves
+    uint32_t getRevision() const { return mRevision; }
+    // height above the floor in mm is depth * scale + camera height in mm
+    const cv::Mat& getHeightScale() const { return mHeightScale; }
+
+    // 255 where a pixel with a usable depth is between minHeight and
+    // maxHeight millimetres above the floor, 0 elsewhere; only rect of the
+    // depth-sized mask is written
+    void segment( const cv::Mat &depth, const cv::Rect &rect, int nearLimit, int farLimit, float minHeight, float maxHeight, cv::Mat &mask ) const;
+
+private:
+    void sample( const cv::Mat &depth, const DepthProjector &projector, int nearLimit, int farLimit );
+    // steep counts hypotheses rejected by maxTilt
+    bool fitRansac( int &steep );
+    // least squares over the current sample's inliers; returns their fraction
+    float refine();
+    void buildTable( const DepthProjector &projector );
+
+    Params mParams;
+    cv::RNG mRng;
+    std::vector<cv::Point3f> mSamples;
+
+    bool mValid;
+    cv::Vec3f mNormal;
+    float mOffset;
+    float mInlierFraction;
+    int mFramesToCheck;
+    uint32_t mRevision;
+    // a failed search is logged once until a plane is found
+    bool mMissingLogged;
+
+    cv::Mat mHeightScale;
+};
@@ -0,0 +1,136 @@
+//
+//  Logger.cpp
+//  MotionTrackingTest
+//
+
+#include "Logger.h"
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+
+namespace {
+    const char* sLevelNames[] = { "TRACE", "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+    const std::chrono::steady_clock::time_point sEpoch = std::chrono::steady_clock::now();
+
+    uint64_t microsSinceEpoch(){
+        return std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - sEpoch ).count();
+    }
+}
+
+Logger& Logger::instance(){
+    static Logger sLogger;
+    return sLogger;
+}
+
+Logger::Logger() :
+mEnqueuePos(0),
+mDequeuePos(0),
+mDropped(0),
+mLevel(MT_LOG_MIN_LEVEL),
+mRunning(true),
+mOutput(&std::cout)
+{
+    for( uint32_t i = 0; i < CAPACITY; i++ ){
+        mSlots[i].sequence.store( i, std::memory_order_relaxed );
+    }
+    mThread = std::thread( &Logger::run, this );
+}
+
+Logger::~Logger(){
+    mRunning = false;
+    if( mThread.joinable() ){
+        mThread.join();
+    }
+}
+
+void Logger::setOutput( std::ostream* output ){
+    std::lock_guard<std::mutex> lock( mOutputMutex );
+    mOutput = output;
+}
+
+void Logger::push( int level, const char* message, const double* args, int numArgs ){
+    // bounded multi-producer queue: claim a slot by advancing the enqueue position
+    uint32_t pos = mEnqueuePos.load( std::memory_order_relaxed );
+    Slot* slot;
+    for(;;){
+        slot = &mSlots[pos & ( CAPACITY - 1 )];
+        uint32_t seq = slot->sequence.load( std::memory_order_acquire );
+        int32_t diff = (int32_t)( seq - pos );
+        if( diff == 0 ){
+            if( mEnqueuePos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ){
+                break;
+            }
+        } else if( diff < 0 ){
+            // full, the consumer has not caught up
+            mDropped.fetch_add( 1, std::memory_order_relaxed );
+            return;
+        } else {
+            pos = mEnqueuePos.load( std::memory_order_relaxed );
+        }
+    }
+
+    Record &record = slot->record;
+    record.timestamp = microsSinceEpoch();
+    record.message = message;
+    record.level = level;
+    record.numArgs = numArgs;
+    for( int i = 0; i < numArgs; i++ ){
+        record.args[i] = args[i];
+    }
+    slot->sequence.store( pos + 1, std::memory_order_release );
+}
+
+bool Logger::pop( Record &record ){
+    Slot &slot = mSlots[mDequeuePos & ( CAPACITY - 1 )];
+    uint32_t seq = slot.sequence.load( std::memory_order_acquire );
+    if( (int32_t)( seq - ( mDequeuePos + 1 ) ) < 0 ){
+        return false;
+    }
+    record = slot.record;
+    slot.sequence.store( mDequeuePos + CAPACITY, std::memory_order_release );
+    mDequeuePos++;
+    return true;
+}
+
+void Logger::run(){
+    Record record;
+    for(;;){
+        bool running = mRunning;
+        bool wrote = false;
+        while( pop( record ) ){
+            format( record );
+            wrote = true;
+        }
+
+        uint32_t dropped = mDropped.exchange( 0, std::memory_order_relaxed );
+        {
+            std::lock_guard<std::mutex> lock( mOutputMutex );
+            if( dropped > 0 ){
+                *mOutput << "(" << dropped << " log records dropped)" << "\n";
+                wrote = true;
+            }
+            if( wrote ){
+                mOutput->flush();
+            }
+        }
+
+        if( ! running ){
+            break;
+        }
+        std::this_thread::sleep_for( std::chrono::milliseconds( 5 ) );
+    }
+}
+
+void Logger::format( const Record &record ){
+    char line[512];
+    int length = snprintf( line, sizeof( line ), "[%12.6f] %s %s", record.timestamp / 1.0e6,
+                          sLevelNames[record.level < LEVEL_OFF ? record.level : LEVEL_ERROR], record.message );
+    for( int i = 0; i < record.numArgs && length < (int)sizeof( line ); i++ ){
+        length += snprintf( line + length, sizeof( line ) - length, " %.15g", record.args[i] );
+    }
+
+    std::lock_guard<std::mutex> lock( mOutputMutex );
+    *mOutput << line << "\n";
+}
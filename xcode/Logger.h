@@ -0,0 +1,122 @@
+//
+//  Logger.h
+//  MotionTrackingTest
+//
+//  Low overhead logging for the tracking thread. Call sites write a fixed-size
+//  binary record (a static message plus up to four numbers) into a lock-free
+//  ring buffer; a background thread formats and flushes them.
+//
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <thread>
+
+// sites below this level are compiled out entirely
+#ifndef MT_LOG_MIN_LEVEL
+    #ifdef NDEBUG
+        #define MT_LOG_MIN_LEVEL 2
+    #else
+        #define MT_LOG_MIN_LEVEL 1
+    #endif
+#endif
+
+class Logger {
+public:
+    enum Level {
+        LEVEL_TRACE = 0,
+        LEVEL_DEBUG,
+        LEVEL_INFO,
+        LEVEL_WARN,
+        LEVEL_ERROR,
+        LEVEL_OFF
+    };
+
+    static const int MAX_ARGS = 4;
+
+    struct Record {
+        uint64_t timestamp;
+        // must have static storage duration, only the pointer is stored
+        const char* message;
+        int level;
+        int numArgs;
+        double args[MAX_ARGS];
+    };
+
+    static Logger& instance();
+    ~Logger();
+
+    void setLevel( int level ) { mLevel.store( level, std::memory_order_relaxed ); }
+    int getLevel() const { return mLevel.load( std::memory_order_relaxed ); }
+    bool isEnabled( int level ) const { return level >= getLevel(); }
+
+    // where the background thread writes formatted records, std::cout by default
+    void setOutput( std::ostream* output );
+
+    // never blocks; drops the record if the ring is full
+    void write( int level, const char* message ) { push( level, message, 0, 0 ); }
+    void write( int level, const char* message, double a ) { double v[] = { a }; push( level, message, v, 1 ); }
+    void write( int level, const char* message, double a, double b ) { double v[] = { a, b }; push( level, message, v, 2 ); }
+    void write( int level, const char* message, double a, double b, double c ) { double v[] = { a, b, c }; push( level, message, v, 3 ); }
+    void write( int level, const char* message, double a, double b, double c, double d ) { double v[] = { a, b, c, d }; push( level, message, v, 4 ); }
+
+private:
+    Logger();
+    Logger( const Logger& );
+    Logger& operator=( const Logger& );
+
+    // capacity of the ring, must be a power of two
+    static const uint32_t CAPACITY = 4096;
+
+    struct Slot {
+        std::atomic<uint32_t> sequence;
+        Record record;
+    };
+
+    void push( int level, const char* message, const double* args, int numArgs );
+    bool pop( Record &record );
+    void run();
+    void format( const Record &record );
+
+    Slot mSlots[CAPACITY];
+    std::atomic<uint32_t> mEnqueuePos;
+    uint32_t mDequeuePos;
+    std::atomic<uint32_t> mDropped;
+    std::atomic<int> mLevel;
+    std::atomic<bool> mRunning;
+
+    std::mutex mOutputMutex;
+    std::ostream* mOutput;
+    std::thread mThread;
+};
+
+#define MT_LOG( level, ... ) \
+    do { if( Logger::instance().isEnabled( level ) ) Logger::instance().write( level, __VA_ARGS__ ); } while( 0 )
+
+#if MT_LOG_MIN_LEVEL <= 0
+    #define MT_LOG_TRACE( ... ) MT_LOG( Logger::LEVEL_TRACE, __VA_ARGS__ )
+#else
+    #define MT_LOG_TRACE( ... ) do {} while( 0 )
+#endif
+
+#if MT_LOG_MIN_LEVEL <= 1
+    #define MT_LOG_DEBUG( ... ) MT_LOG( Logger::LEVEL_DEBUG, __VA_ARGS__ )
+#else
+    #define MT_LOG_DEBUG( ... ) do {} while( 0 )
+#endif
+
+#if MT_LOG_MIN_LEVEL <= 2
+    #define MT_LOG_INFO( ... ) MT_LOG( Logger::LEVEL_INFO, __VA_ARGS__ )
+#else
+    #define MT_LOG_INFO( ... ) do {} while( 0 )
+#endif
+
+#if MT_LOG_MIN_LEVEL <= 3
+    #define MT_LOG_WARN( ... ) MT_LOG( Logger::LEVEL_WARN, __VA_ARGS__ )
+#else
+    #define MT_LOG_WARN( ... ) do {} while( 0 )
+#endif
+
+#define MT_LOG_ERROR( ... ) MT_LOG( Logger::LEVEL_ERROR, __VA_ARGS__ )
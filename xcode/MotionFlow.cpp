@@ -0,0 +1,130 @@
+//
+//  MotionFlow.cpp
+//  MotionTrackingTest
+//
+
+#include "MotionFlow.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+    // fewer followed features than this leave the track's velocity alone
+    const size_t MIN_FOLLOWED = 3;
+
+    float median( vector<float> &values ){
+        nth_element( values.begin(), values.begin() + values.size() / 2, values.end() );
+        return values[values.size() / 2];
+    }
+}
+
+MotionFlow::Params::Params() :
+maxFeatures(8),
+winSize(15),
+levels(2),
+quality(0.01),
+minDistance(3.0)
+{
+}
+
+MotionFlow::MotionFlow( const Params &params ) :
+mParams(params),
+mPreviousTimestamp(0)
+{
+}
+
+void MotionFlow::reset(){
+    mImage.release();
+    mPreviousImage.release();
+    mPyramid.clear();
+    mPreviousPyramid.clear();
+    mPreviousTimestamp = 0;
+    mFeatures.clear();
+}
+
+void MotionFlow::update( const cv::Mat &gray, uint64_t imageTimestamp, const cv::Size &depthSize, uint64_t depthTimestamp, vector<Shape> &tracks ){
+    if( gray.empty() || tracks.empty() ){
+        mFeatures.clear();
+    }
+    if( gray.empty() || depthSize.area() == 0 ){
+        return;
+    }
+    if( ! mImage.empty() && mImage.size() != gray.size() ){
+        reset();
+    }
+
+    // the pyramid may point into the image, so both are kept for the next frame
+    std::swap( mPreviousImage, mImage );
+    std::swap( mPreviousPyramid, mPyramid );
+    mImage = gray;
+    cv::Size winSize( mParams.winSize, mParams.winSize );
+    cv::buildOpticalFlowPyramid( mImage, mPyramid, winSize, mParams.levels );
+
+    float dt = ( imageTimestamp - mPreviousTimestamp ) / 1.0e6f;
+    bool haveFlow = ! mPreviousPyramid.empty() && mPreviousTimestamp != 0 && imageTimestamp > mPreviousTimestamp;
+    mPreviousTimestamp = imageTimestamp;
+
+    // every track's features through one flow call
+    mPoints.clear();
+    map<int, pair<size_t, size_t> > ranges;
+    for( const Shape &track : tracks ){
+        map<int, vector<cv::Point2f> >::iterator it = mFeatures.find( track.ID );
+        if( it != mFeatures.end() && ! it->second.empty() ){
+            ranges[track.ID] = make_pair( mPoints.size(), mPoints.size() + it->second.size() );
+            mPoints.insert( mPoints.end(), it->second.begin(), it->second.end() );
+        }
+    }
+    if( haveFlow && ! mPoints.empty() ){
+        cv::calcOpticalFlowPyrLK( mPreviousPyramid, mPyramid, mPoints, mMoved, mStatus, mErrors, winSize, mParams.levels );
+    } else {
+        haveFlow = false;
+    }
+
+    // boxes and velocities are in depth image pixels
+    float scaleX = (float)gray.cols / depthSize.width;
+    float scaleY = (float)gray.rows / depthSize.height;
+    map<int, vector<cv::Point2f> > features;
+    vector<float> dx, dy;
+    for( Shape &track : tracks ){
+        // only tracks matched this frame are active
+        if( track.lastSeenTimestamp != depthTimestamp ){
+            continue;
+        }
+        vector<cv::Point2f> &kept = features[track.ID];
+        map<int, pair<size_t, size_t> >::const_iterator range = ranges.find( track.ID );
+        if( haveFlow && range != ranges.end() ){
+            dx.clear();
+            dy.clear();
+            for( size_t i = range->second.first; i < range->second.second; i++ ){
+                if( mStatus[i] ){
+                    dx.push_back( mMoved[i].x - mPoints[i].x );
+                    dy.push_back( mMoved[i].y - mPoints[i].y );
+                    kept.push_back( mMoved[i] );
+                }
+            }
+            if( dx.size() >= MIN_FOLLOWED ){
+                track.velocity = cv::Point2f( median( dx ) / ( scaleX * dt ), median( dy ) / ( scaleY * dt ) );
+            }
+        }
+        if( kept.size() * 2 < (size_t)mParams.maxFeatures ){
+            const cv::Rect &box = track.boundingRect;
+            detect( cv::Rect( (int)( box.x * scaleX ), (int)( box.y * scaleY ), (int)( box.width * scaleX ), (int)( box.height * scaleY ) ), kept );
+        }
+    }
+    mFeatures.swap( features );
+}
+
+// tops up features from the strongest corners inside box
+void MotionFlow::detect( const cv::Rect &box, vector<cv::Point2f> &features ){
+    cv::Rect rect = box & cv::Rect( 0, 0, mImage.cols, mImage.rows );
+    if( rect.width < 3 || rect.height < 3 ){
+        return;
+    }
+    vector<cv::Point2f> corners;
+    cv::goodFeaturesToTrack( mImage( rect ), corners, mParams.maxFeatures, mParams.quality, mParams.minDistance );
+    features.clear();
+    for( const cv::Point2f &corner : corners ){
+        features.push_back( corner + cv::Point2f( (float)rect.x, (float)rect.y ) );
+    }
+}
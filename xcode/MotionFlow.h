@@ -0,0 +1,60 @@
+//
+//  MotionFlow.h
+//  MotionTrackingTest
+//
+//  Per-track velocity from sparse optical flow, steadier than differencing
+//  centroids whose outline changes shape from frame to frame. A few good
+//  features are kept inside each active track's box and followed with
+//  pyramidal Lucas-Kanade; the median of their motion is the track's
+//  velocity. Pyramids are built once per frame and reused as the previous
+//  frame's on the next, and all tracks go through a single flow call.
+//
+//  The image can be the color or IR stream, at any resolution, as long as
+//  it is registered to the depth image the boxes come from.
+//
+
+#pragma once
+#include "Shape.h"
+
+#include <map>
+#include <vector>
+
+class MotionFlow {
+public:
+    struct Params {
+        Params();
+
+        int maxFeatures;
+        int winSize;
+        int levels;
+        double quality;
+        double minDistance;
+    };
+
+    explicit MotionFlow( const Params &params = Params() );
+
+    void reset();
+    // gray is 8-bit single channel taken at imageTimestamp, covering the same
+    // view as a depth image of depthSize; tracks matched in the depth frame
+    // at depthTimestamp get their velocity (depth image px/s) from flow when
+    // enough features were followed. Flow is timed by the images' own
+    // timestamps, which needn't line up with depth frames
+    void update( const cv::Mat &gray, uint64_t imageTimestamp, const cv::Size &depthSize, uint64_t depthTimestamp, std::vector<Shape> &tracks );
+
+private:
+    void detect( const cv::Rect &box, std::vector<cv::Point2f> &features );
+
+    Params mParams;
+    cv::Mat mImage;
+    cv::Mat mPreviousImage;
+    std::vector<cv::Mat> mPyramid;
+    std::vector<cv::Mat> mPreviousPyramid;
+    uint64_t mPreviousTimestamp;
+    // features per track ID, in flow image coordinates
+    std::map<int, std::vector<cv::Point2f> > mFeatures;
+
+    std::vector<cv::Point2f> mPoints;
+    std::vector<cv::Point2f> mMoved;
+    std::vector<uchar> mStatus;
+    std::vector<float> mErrors;
+};
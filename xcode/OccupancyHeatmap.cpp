@@ -0,0 +1,206 @@
+//
+//  OccupancyHeatmap.cpp
+//  MotionTrackingTest
+//
+
+#include "OccupancyHeatmap.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+
+namespace {
+    // added per foreground pixel per frame; leaves headroom in 32 bits for
+    // half-lives of several days at 30 fps
+    const uint32_t WEIGHT = 64;
+    // each decay step keeps 15/16, so a half-life takes ln 0.5 / ln( 15/16 ) steps
+    const double STEPS_PER_HALF_LIFE = 10.7401;
+    const float MIN_HALF_LIFE = 1.0f;
+    const float MAX_HALF_LIFE = 72 * 3600.0f;
+    const float MIN_SNAPSHOT_INTERVAL = 1.0f;
+
+    // acc = acc - ceil( acc / 16 ) when decaying, then + WEIGHT where mask is set
+    void accumulateRow( uint32_t* acc, const uint8_t* mask, int width, bool decay ){
+        int x = 0;
+#if defined( __SSE2__ )
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i weight = _mm_set1_epi32( WEIGHT );
+        const __m128i round = _mm_set1_epi32( 15 );
+        for( ; x + 16 <= width; x += 16 ){
+            // 0xff for empty mask bytes, widened to one 32-bit lane per pixel
+            __m128i empty = _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i*)( mask + x ) ), zero );
+            __m128i empty16[2] = { _mm_unpacklo_epi8( empty, empty ), _mm_unpackhi_epi8( empty, empty ) };
+            for( int half = 0; half < 2; half++ ){
+                __m128i empty32[2] = { _mm_unpacklo_epi16( empty16[half], empty16[half] ), _mm_unpackhi_epi16( empty16[half], empty16[half] ) };
+                for( int quarter = 0; quarter < 2; quarter++ ){
+                    __m128i* p = (__m128i*)( acc + x + half * 8 + quarter * 4 );
+                    __m128i a = _mm_loadu_si128( p );
+                    if( decay ){
+                        a = _mm_sub_epi32( a, _mm_srli_epi32( _mm_add_epi32( a, round ), 4 ) );
+                    }
+                    a = _mm_add_epi32( a, _mm_andnot_si128( empty32[quarter], weight ) );
+                    _mm_storeu_si128( p, a );
+                }
+            }
+        }
+#endif
+        for( ; x < width; x++ ){
+            uint32_t a = acc[x];
+            if( decay ){
+                a -= ( a + 15 ) >> 4;
+            }
+            acc[x] = a + ( mask[x] ? WEIGHT : 0 );
+        }
+    }
+}
+
+OccupancyHeatmap::OccupancyHeatmap() :
+mWidth(0),
+mHeight(0),
+mHalfLife(600.0f),
+mSnapshotSeconds(60.0f),
+mLastTimestamp(0),
+mNextDecay(0),
+mNextSnapshot(0),
+mAccumulateMs(0.0f),
+mSnapshotBusy(false),
+mSnapshotId(0),
+mRunning(true),
+mSnapshotRequested(false)
+{
+    mThread = std::thread( &OccupancyHeatmap::run, this );
+}
+
+OccupancyHeatmap::~OccupancyHeatmap(){
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mRunning = false;
+    }
+    mCondition.notify_one();
+    mThread.join();
+}
+
+void OccupancyHeatmap::setup( int width, int height, float halfLifeSeconds, float snapshotSeconds, const std::string &directory ){
+    mWidth = width;
+    mHeight = height;
+    mAccumulator.assign( width * height, 0 );
+    mEmptyRow.assign( width, 0 );
+    mSnapshotSource.assign( width * height, 0 );
+    setHalfLife( halfLifeSeconds );
+    setSnapshotInterval( snapshotSeconds );
+    mDirectory = directory;
+    mLastTimestamp = 0;
+}
+
+void OccupancyHeatmap::setHalfLife( float seconds ){
+    mHalfLife = std::min( std::max( seconds, MIN_HALF_LIFE ), MAX_HALF_LIFE );
+}
+
+void OccupancyHeatmap::setSnapshotInterval( float seconds ){
+    mSnapshotSeconds = std::max( seconds, MIN_SNAPSHOT_INTERVAL );
+}
+
+void OccupancyHeatmap::accumulate( const cv::Mat &mask, uint64_t timestamp ){
+    if( mAccumulator.empty() || ( ! mask.empty() && ( mask.cols != mWidth || mask.rows != mHeight || mask.type() != CV_8UC1 ) ) ){
+        return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // restart the clocks if time jumps back, e.g. a replay looping
+    if( mLastTimestamp == 0 || timestamp < mLastTimestamp ){
+        mNextDecay = timestamp;
+        mNextSnapshot = timestamp + (uint64_t)( mSnapshotSeconds * 1.0e6f );
+    }
+    mLastTimestamp = timestamp;
+
+    bool decay = timestamp >= mNextDecay;
+    if( decay ){
+        uint64_t interval = (uint64_t)( mHalfLife * 1.0e6 / STEPS_PER_HALF_LIFE );
+        mNextDecay = std::max( mNextDecay + interval, timestamp );
+    }
+    for( int y = 0; y < mHeight; y++ ){
+        accumulateRow( &mAccumulator[y * mWidth], mask.empty() ? mEmptyRow.data() : mask.ptr( y ), mWidth, decay );
+    }
+
+    // skipped if the previous snapshot is still being written
+    if( timestamp >= mNextSnapshot && ! mSnapshotBusy.exchange( true ) ){
+        mNextSnapshot = timestamp + (uint64_t)( mSnapshotSeconds * 1.0e6f );
+        memcpy( mSnapshotSource.data(), mAccumulator.data(), mAccumulator.size() * sizeof( uint32_t ) );
+        {
+            std::lock_guard<std::mutex> lock( mMutex );
+            mSnapshotRequested = true;
+        }
+        mCondition.notify_one();
+    }
+
+    float ms = std::chrono::duration<float, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    mAccumulateMs += ( ms - mAccumulateMs ) * 0.05f;
+}
+
+cv::Mat OccupancyHeatmap::getSnapshot( uint32_t &snapshotId ){
+    std::lock_guard<std::mutex> lock( mMutex );
+    snapshotId = mSnapshotId;
+    return mSnapshot;
+}
+
+void OccupancyHeatmap::run(){
+    std::unique_lock<std::mutex> lock( mMutex );
+    for(;;){
+        mCondition.wait( lock, [this]{ return mSnapshotRequested || ! mRunning; } );
+        if( ! mSnapshotRequested ){
+            break;
+        }
+        mSnapshotRequested = false;
+        lock.unlock();
+        makeSnapshot();
+        mSnapshotBusy = false;
+        lock.lock();
+    }
+}
+
+void OccupancyHeatmap::makeSnapshot(){
+    uint32_t peak = *std::max_element( mSnapshotSource.begin(), mSnapshotSource.end() );
+    // a fresh Mat per snapshot, so readers can keep the previous one
+    cv::Mat image( mHeight, mWidth, CV_8UC1 );
+    float scale = peak ? 255.0f / peak : 0.0f;
+    for( int y = 0; y < mHeight; y++ ){
+        const uint32_t* in = &mSnapshotSource[y * mWidth];
+        uint8_t* out = image.ptr( y );
+        for( int x = 0; x < mWidth; x++ ){
+            out[x] = (uint8_t)( in[x] * scale + 0.5f );
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mSnapshot = image;
+        mSnapshotId++;
+    }
+    MT_LOG_DEBUG( "heatmap: snapshot taken, accumulate ms", mAccumulateMs );
+
+    if( mDirectory.empty() ){
+        return;
+    }
+    // written aside and renamed over the last one, so a reader never sees
+    // half a file
+    std::string path = mDirectory + "/heatmap-latest.pgm";
+    std::string partial = path + ".part";
+    FILE* file = fopen( partial.c_str(), "wb" );
+    if( file == NULL ){
+        MT_LOG_ERROR( "heatmap: could not write snapshot" );
+        return;
+    }
+    fprintf( file, "P5\n%d %d\n255\n", mWidth, mHeight );
+    bool written = fwrite( image.data, 1, mWidth * mHeight, file ) == (size_t)( mWidth * mHeight );
+    written = fclose( file ) == 0 && written;
+    if( ! written || rename( partial.c_str(), path.c_str() ) != 0 ){
+        MT_LOG_ERROR( "heatmap: could not write snapshot" );
+        remove( partial.c_str() );
+    }
+}
@@ -0,0 +1,76 @@
+//
+//  OccupancyHeatmap.h
+//  MotionTrackingTest
+//
+//  Long-running dwell heatmap over the depth view. Every frame adds a fixed
+//  weight to each foreground pixel of a 32-bit accumulator, four pixels per
+//  SSE2 add, and the whole map decays exponentially with a configurable
+//  half-life. Decay is applied as a 1/16 step folded into the same pass
+//  whenever it falls due, so a frame costs a single sweep over the buffer.
+//
+//  Snapshots are copied out on the tracking thread and scaled, kept and
+//  written as an 8-bit PGM image on a background thread. Each one replaces
+//  heatmap-latest.pgm, so a kiosk running for months keeps a single file.
+//
+
+#pragma once
+#include "opencv2/opencv.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class OccupancyHeatmap {
+public:
+    OccupancyHeatmap();
+    ~OccupancyHeatmap();
+
+    // snapshots are written to directory when it is not empty
+    void setup( int width, int height, float halfLifeSeconds, float snapshotSeconds, const std::string &directory );
+    bool isSetup() const { return ! mAccumulator.empty(); }
+    // safe to call from another thread, picked up on the next frame
+    void setHalfLife( float seconds );
+    // safe to call from another thread, applies from the next snapshot
+    void setSnapshotInterval( float seconds );
+
+    // called from the tracking thread with an 8-bit mask, non-zero where
+    // something is present, or an empty Mat when nothing is, so only the
+    // decay runs; timestamp in sensor microseconds
+    void accumulate( const cv::Mat &mask, uint64_t timestamp );
+
+    // the latest snapshot scaled to its busiest pixel, empty until there is one
+    cv::Mat getSnapshot( uint32_t &snapshotId );
+    // running mean cost of accumulate()
+    float getAccumulateMs() const { return mAccumulateMs; }
+
+private:
+    void run();
+    void makeSnapshot();
+
+    int mWidth;
+    int mHeight;
+    std::vector<uint32_t> mAccumulator;
+    // stands in for every row of an empty mask
+    std::vector<uint8_t> mEmptyRow;
+    std::atomic<float> mHalfLife;
+    std::atomic<float> mSnapshotSeconds;
+    std::string mDirectory;
+    uint64_t mLastTimestamp;
+    uint64_t mNextDecay;
+    uint64_t mNextSnapshot;
+    float mAccumulateMs;
+
+    // handed to the snapshot thread while mSnapshotBusy is set
+    std::vector<uint32_t> mSnapshotSource;
+    std::atomic<bool> mSnapshotBusy;
+    cv::Mat mSnapshot;
+    uint32_t mSnapshotId;
+    bool mRunning;
+    bool mSnapshotRequested;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::thread mThread;
+};
@@ -0,0 +1,121 @@
+//
+//  ReIdentifier.cpp
+//  MotionTrackingTest
+//
+
+#include "ReIdentifier.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+    // nearest descriptors checked against the distance gate
+    const int CANDIDATES = 8;
+}
+
+ReIdentifier::Params::Params() :
+maxAgeMicros(30000000),
+maxDistance(0.2f),
+minMetres(0.3f),
+metresPerSecond(1.5f)
+{
+}
+
+ReIdentifier::ReIdentifier( const Params &params ) :
+mParams(params),
+mDirty(false)
+{
+}
+
+void ReIdentifier::reset(){
+    mDescriptors.clear();
+    mIDs.clear();
+    mLostTimestamps.clear();
+    mLostPositions.clear();
+    mLastSeenTimestamps.clear();
+    mIndex.reset();
+    mDirty = false;
+}
+
+void ReIdentifier::lose( const Shape &track, uint64_t timestamp ){
+    if( ! track.appearance.valid || track.position.z <= 0.0f ){
+        return;
+    }
+    mDescriptors.insert( mDescriptors.end(), track.appearance.values, track.appearance.values + Appearance::SIZE );
+    mIDs.push_back( track.ID );
+    mLostTimestamps.push_back( timestamp );
+    mLostPositions.push_back( track.position );
+    mLastSeenTimestamps.push_back( track.lastSeenTimestamp );
+    mDirty = true;
+}
+
+int ReIdentifier::find( const Shape &shape, uint64_t timestamp ){
+    const Appearance &appearance = shape.appearance;
+    if( ! appearance.valid || shape.position.z <= 0.0f ){
+        return -1;
+    }
+    prune( timestamp );
+    if( mIDs.empty() ){
+        return -1;
+    }
+    if( mDirty || ! mIndex ){
+        // the tree keeps its own reordered copy of the rows
+        cvflann::Matrix<float> dataset( mDescriptors.data(), mIDs.size(), Appearance::SIZE );
+        mIndex.reset( new cvflann::KDTreeSingleIndex<Distance>( dataset, cvflann::KDTreeSingleIndexParams( 10, true ) ) );
+        mIndex->buildIndex();
+        mDirty = false;
+    }
+
+    float query[Appearance::SIZE];
+    std::copy( appearance.values, appearance.values + Appearance::SIZE, query );
+    int k = std::min( CANDIDATES, (int)mIDs.size() );
+    int nearest[CANDIDATES];
+    float distance[CANDIDATES];
+    cvflann::Matrix<float> queries( query, 1, Appearance::SIZE );
+    cvflann::Matrix<int> indices( nearest, 1, k );
+    cvflann::Matrix<float> distances( distance, 1, k );
+    mIndex->knnSearch( queries, indices, distances, k, cvflann::SearchParams() );
+
+    // closest in appearance first; L2 here is squared
+    for( int i = 0; i < k; i++ ){
+        if( nearest[i] < 0 || distance[i] > mParams.maxDistance * mParams.maxDistance ){
+            break;
+        }
+        uint64_t lastSeen = mLastSeenTimestamps[nearest[i]];
+        float gone = timestamp > lastSeen ? ( timestamp - lastSeen ) / 1.0e6f : 0.0f;
+        float reach = mParams.minMetres + mParams.metresPerSecond * gone;
+        cv::Point3f moved = shape.position - mLostPositions[nearest[i]];
+        if( moved.dot( moved ) <= reach * reach ){
+            int ID = mIDs[nearest[i]];
+            remove( nearest[i] );
+            return ID;
+        }
+    }
+    return -1;
+}
+
+// exits are appended in time order, so the stale ones are at the front
+void ReIdentifier::prune( uint64_t timestamp ){
+    size_t stale = 0;
+    while( stale < mLostTimestamps.size() && ( timestamp < mLostTimestamps[stale] || timestamp - mLostTimestamps[stale] > mParams.maxAgeMicros ) ){
+        stale++;
+    }
+    if( stale > 0 ){
+        mDescriptors.erase( mDescriptors.begin(), mDescriptors.begin() + stale * Appearance::SIZE );
+        mIDs.erase( mIDs.begin(), mIDs.begin() + stale );
+        mLostTimestamps.erase( mLostTimestamps.begin(), mLostTimestamps.begin() + stale );
+        mLostPositions.erase( mLostPositions.begin(), mLostPositions.begin() + stale );
+        mLastSeenTimestamps.erase( mLastSeenTimestamps.begin(), mLastSeenTimestamps.begin() + stale );
+        mDirty = true;
+    }
+}
+
+void ReIdentifier::remove( size_t index ){
+    mDescriptors.erase( mDescriptors.begin() + index * Appearance::SIZE, mDescriptors.begin() + ( index + 1 ) * Appearance::SIZE );
+    mIDs.erase( mIDs.begin() + index );
+    mLostTimestamps.erase( mLostTimestamps.begin() + index );
+    mLostPositions.erase( mLostPositions.begin() + index );
+    mLastSeenTimestamps.erase( mLastSeenTimestamps.begin() + index );
+    mDirty = true;
+}
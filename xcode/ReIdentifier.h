@@ -0,0 +1,67 @@
+//
+//  ReIdentifier.h
+//  MotionTrackingTest
+//
+//  Remembers recently lost tracks by appearance so a blob that reappears
+//  can take its old ID back instead of a new one. Lost tracks' descriptors
+//  sit in a FLANN single kd-tree, rebuilt only when a query finds the set
+//  changed, so a lookup against thousands of recent exits stays well under
+//  a millisecond. Appearance alone can't tell similarly built people apart,
+//  so a candidate must also be within walking distance of where it was lost.
+//
+
+#pragma once
+#include "Shape.h"
+#include "opencv2/flann/dist.h"
+#include "opencv2/flann/kdtree_single_index.h"
+
+#include <memory>
+#include <vector>
+
+class ReIdentifier {
+public:
+    struct Params {
+        Params();
+
+        // lost tracks older than this are forgotten
+        uint64_t maxAgeMicros;
+        // furthest descriptor distance accepted as the same person
+        float maxDistance;
+        // a candidate must reappear within minMetres of where it was lost,
+        // plus metresPerSecond for every second it has been gone
+        float minMetres;
+        float metresPerSecond;
+    };
+
+    explicit ReIdentifier( const Params &params = Params() );
+
+    void setParams( const Params &params ) { mParams = params; }
+    void reset();
+
+    // remembers a track that has just expired, if it has an appearance and
+    // a position
+    void lose( const Shape &track, uint64_t timestamp );
+    // ID of the lost track closest in appearance within maxDistance that
+    // could have walked to shape's position, which is then forgotten, or -1
+    int find( const Shape &shape, uint64_t timestamp );
+
+    size_t getLostCount() const { return mIDs.size(); }
+
+private:
+    typedef cvflann::L2<float> Distance;
+
+    void prune( uint64_t timestamp );
+    void remove( size_t index );
+
+    Params mParams;
+    // one row of Appearance::SIZE floats per lost track
+    std::vector<float> mDescriptors;
+    std::vector<int> mIDs;
+    std::vector<uint64_t> mLostTimestamps;
+    // where and when each was last matched
+    std::vector<cv::Point3f> mLostPositions;
+    std::vector<uint64_t> mLastSeenTimestamps;
+
+    std::unique_ptr< cvflann::KDTreeSingleIndex<Distance> > mIndex;
+    bool mDirty;
+};
@@ -9,9 +9,15 @@
 #include "Shape.h"
 
 Shape::Shape() :
-centroid( cv::Point() ),
 ID(-1),
-lastFrameSeen(-1),
-matchFound(false)
+centroid( cv::Point() ),
+velocity( cv::Point2f() ),
+position( cv::Point3f() ),
+height(0.0f),
+footprint(0.0f),
+depthDeviation(0.0f),
+huValid(false),
+matchFound(false),
+lastSeenTimestamp(0)
 {
 }
\ No newline at end of file
@@ -7,7 +7,19 @@
 //
 
 #pragma once
-#include "CinderOpenCV.h"
+#include "opencv2/opencv.hpp"
+
+// compact appearance for recognising a track that comes back: a normalised
+// histogram of the blob's depth profile plus its height and footprint
+struct Appearance {
+    static const int BINS = 16;
+    static const int SIZE = BINS + 2;
+
+    Appearance() : valid( false ) { std::fill( values, values + SIZE, 0.0f ); }
+
+    float values[SIZE];
+    bool valid;
+};
 
 class Shape {
 public:
@@ -15,8 +27,26 @@ public:
     
     int ID;
     double area;
+    // head point instead when the tracker is tracking heads
     cv::Point centroid;
-    Boolean matchFound;
+    cv::Rect boundingRect;
+    // pixels per second, from centroid motion between matched frames
+    cv::Point2f velocity;
+    // metres in camera space, z is 0 when no pixel had a usable depth
+    cv::Point3f position;
+    // vertical extent and visible surface, metres and square metres
+    float height;
+    float footprint;
+    // spread of depth over the blob, metres
+    float depthDeviation;
+    // Hu invariants of the outline, log scaled as matchShapes compares them,
+    // with magnitudes under 1e-5 clamped to it; huValid is false and hu all 0
+    // when the outline is too small
+    cv::Vec<float, 7> hu;
+    bool huValid;
+    Appearance appearance;
+    bool matchFound;
     cv::vector<cv::Point> hull;
-    int lastFrameSeen;
+    // sensor timestamp (microseconds) of the last frame this shape was matched in
+    uint64_t lastSeenTimestamp;
 };
@@ -0,0 +1,230 @@
+//
+//  TopDownGrid.cpp
+//  MotionTrackingTest
+//
+
+#include "TopDownGrid.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+using namespace std;
+
+namespace {
+    // per-blob sums while crediting pixels
+    struct Blob {
+        Blob() : pixels( 0 ), cells( 0 ), top( 0 ), minX( INT_MAX ), minY( INT_MAX ), maxX( INT_MIN ), maxY( INT_MIN ), sumX( 0 ), sumY( 0 ), sumZ( 0.0 ), sumZ2( 0.0 ), rowY( -1 ), rowMinX( 0 ), rowMaxX( 0 ) {}
+
+        // ends the row being credited, keeping its leftmost and rightmost pixel
+        void endRow(){
+            if( rowY >= 0 ){
+                left.push_back( cv::Point( rowMinX, rowY ) );
+                right.push_back( cv::Point( rowMaxX, rowY ) );
+            }
+        }
+
+        int pixels;
+        int cells;
+        int top;
+        int minX, minY, maxX, maxY;
+        int64_t sumX, sumY;
+        // metres, for the depth spread
+        double sumZ, sumZ2;
+        cv::Point3f position;
+        // image-space outline, built from each row's extent
+        int rowY, rowMinX, rowMaxX;
+        std::vector<cv::Point> left;
+        std::vector<cv::Point> right;
+    };
+}
+
+TopDownGrid::Params::Params() :
+cellSize(0.05f),
+width(8.0f),
+depth(10.0f),
+minCells(8)
+{
+}
+
+TopDownGrid::TopDownGrid( const Params &params ) :
+mParams(params),
+mColumns(0),
+mRows(0),
+mFloorRevision(0),
+mRowOffset(0.0f)
+{
+}
+
+void TopDownGrid::buildTables( const DepthProjector &projector, const FloorPlane &floor ){
+    mColumns = (int)ceilf( mParams.width / mParams.cellSize );
+    mRows = (int)ceilf( mParams.depth / mParams.cellSize );
+    mFloorRevision = floor.getRevision();
+
+    // floor axes: across is the camera's x flattened onto the floor, away is
+    // perpendicular to it and points out from the camera
+    cv::Vec3f up = floor.getNormal();
+    cv::Vec3f across = cv::Vec3f( 1.0f, 0.0f, 0.0f ) - up * up[0];
+    across *= 1.0f / (float)cv::norm( across );
+    cv::Vec3f away = up.cross( across );
+    if( away[2] < 0.0f ){
+        away = -away;
+    }
+
+    // grid column and row per millimetre of depth, column 0 at the left edge
+    float cellsPerMm = 1.0f / ( mParams.cellSize * 1000.0f );
+    const cv::Mat &rays = projector.getRays();
+
+    // row 0 is the camera's foot unless the view reaches behind it, as it
+    // does for a sensor looking down; the view's nearest floor is where one
+    // of the corner rays meets it
+    float nearest = 0.0f;
+    const cv::Point corners[4] = { cv::Point( 0, 0 ), cv::Point( rays.cols - 1, 0 ), cv::Point( 0, rays.rows - 1 ), cv::Point( rays.cols - 1, rays.rows - 1 ) };
+    for( const cv::Point &corner : corners ){
+        const cv::Vec2f &ray = rays.at<cv::Vec2f>( corner );
+        float toFloor = up[0] * ray[0] + up[1] * ray[1] + up[2];
+        if( toFloor < 0.0f ){
+            float z = floor.getCameraHeight() / -toFloor;
+            nearest = std::min( nearest, z * ( away[0] * ray[0] + away[1] * ray[1] + away[2] ) );
+        }
+    }
+    mRowOffset = -nearest / mParams.cellSize;
+
+    mColumnScale.create( rays.rows, rays.cols, CV_32FC1 );
+    mRowScale.create( rays.rows, rays.cols, CV_32FC1 );
+    for( int y = 0; y < rays.rows; y++ ){
+        const cv::Vec2f* ray = rays.ptr<cv::Vec2f>( y );
+        float* column = mColumnScale.ptr<float>( y );
+        float* row = mRowScale.ptr<float>( y );
+        for( int x = 0; x < rays.cols; x++ ){
+            column[x] = ( across[0] * ray[x][0] + across[1] * ray[x][1] + across[2] ) * cellsPerMm;
+            row[x] = ( away[0] * ray[x][0] + away[1] * ray[x][1] + away[2] ) * cellsPerMm;
+        }
+    }
+}
+
+vector<Shape> TopDownGrid::detect( const cv::Mat &depth, const cv::Mat &foreground, const DepthProjector &projector, const FloorPlane &floor, float cutHeight, int minArea ){
+    vector<Shape> shapes;
+    if( ! floor.isValid() ){
+        return shapes;
+    }
+    if( floor.getRevision() != mFloorRevision || mColumnScale.size() != depth.size() ){
+        buildTables( projector, floor );
+    }
+
+    // scatter: tallest point above each cell
+    mHeights.create( mRows, mColumns, CV_16UC1 );
+    mHeights.setTo( 0 );
+    mPixelCells.create( depth.rows, depth.cols, CV_32SC1 );
+    const cv::Mat &heightScale = floor.getHeightScale();
+    float heightOffset = floor.getCameraHeight() * 1000.0f;
+    float columnOffset = mColumns * 0.5f;
+    uint16_t* heights = mHeights.ptr<uint16_t>();
+    for( int y = 0; y < depth.rows; y++ ){
+        const uint16_t* d = depth.ptr<uint16_t>( y );
+        const uint8_t* mask = foreground.ptr( y );
+        const float* columnScale = mColumnScale.ptr<float>( y );
+        const float* rowScale = mRowScale.ptr<float>( y );
+        const float* scale = heightScale.ptr<float>( y );
+        int* cells = mPixelCells.ptr<int>( y );
+        for( int x = 0; x < depth.cols; x++ ){
+            cells[x] = -1;
+            if( mask[x] == 0 ){
+                continue;
+            }
+            int column = (int)( d[x] * columnScale[x] + columnOffset );
+            int row = (int)( d[x] * rowScale[x] + mRowOffset );
+            if( column < 0 || column >= mColumns || row < 0 || row >= mRows ){
+                continue;
+            }
+            int cell = row * mColumns + column;
+            int height = std::min( std::max( (int)( d[x] * scale[x] + heightOffset ), 0 ), 65535 );
+            heights[cell] = std::max<uint16_t>( heights[cell], height );
+            cells[x] = cell;
+        }
+    }
+
+    // blobs of tall cells; closing bridges the gaps far from the camera where
+    // pixels are spread wider than a cell
+    cv::compare( mHeights, cv::Scalar( cutHeight ), mOccupied, cv::CMP_GE );
+    cv::morphologyEx( mOccupied, mOccupied, cv::MORPH_CLOSE, cv::Mat() );
+    cv::Mat scratch = mOccupied.clone();
+    mContours.clear();
+    cv::findContours( scratch, mContours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE );
+
+    mLabels.create( mRows, mColumns, CV_16UC1 );
+    mLabels.setTo( 0 );
+    int labelCount = 0;
+    for( size_t i = 0; i < mContours.size() && labelCount < 65535; i++ ){
+        cv::drawContours( mLabels, mContours, (int)i, cv::Scalar( ++labelCount ), CV_FILLED );
+    }
+    if( labelCount == 0 ){
+        return shapes;
+    }
+
+    vector<Blob> blobs( labelCount + 1 );
+    const uint16_t* labels = mLabels.ptr<uint16_t>();
+    const uint8_t* occupied = mOccupied.ptr();
+    for( int i = 0; i < mRows * mColumns; i++ ){
+        if( labels[i] && occupied[i] ){
+            Blob &blob = blobs[labels[i]];
+            blob.cells++;
+            blob.top = std::max<int>( blob.top, heights[i] );
+        }
+    }
+
+    // credit pixels to the blob their cell belongs to
+    const cv::Mat &rays = projector.getRays();
+    for( int y = 0; y < depth.rows; y++ ){
+        const uint16_t* d = depth.ptr<uint16_t>( y );
+        const cv::Vec2f* ray = rays.ptr<cv::Vec2f>( y );
+        const int* cells = mPixelCells.ptr<int>( y );
+        for( int x = 0; x < depth.cols; x++ ){
+            if( cells[x] < 0 || labels[cells[x]] == 0 ){
+                continue;
+            }
+            Blob &blob = blobs[labels[cells[x]]];
+            float z = d[x] * 0.001f;
+            blob.position += cv::Point3f( ray[x][0] * z, ray[x][1] * z, z );
+            blob.sumZ += z;
+            blob.sumZ2 += (double)z * z;
+            if( blob.rowY != y ){
+                blob.endRow();
+                blob.rowY = y;
+                blob.rowMinX = x;
+            }
+            blob.rowMaxX = x;
+            blob.sumX += x;
+            blob.sumY += y;
+            blob.minX = std::min( blob.minX, x ); blob.maxX = std::max( blob.maxX, x );
+            blob.minY = std::min( blob.minY, y ); blob.maxY = std::max( blob.maxY, y );
+            blob.pixels++;
+        }
+    }
+
+    vector<cv::Point> outline;
+    for( int i = 1; i <= labelCount; i++ ){
+        Blob &blob = blobs[i];
+        if( blob.cells < mParams.minCells || blob.pixels < minArea || blob.pixels == 0 ){
+            continue;
+        }
+        blob.endRow();
+        Shape shape;
+        shape.area = blob.pixels;
+        shape.centroid = cv::Point( (int)( blob.sumX / blob.pixels ), (int)( blob.sumY / blob.pixels ) );
+        shape.boundingRect = cv::Rect( blob.minX, blob.minY, blob.maxX - blob.minX + 1, blob.maxY - blob.minY + 1 );
+        // down the left ends and back up the right ones, simplified as the
+        // contour path simplifies its outlines
+        outline.assign( blob.left.begin(), blob.left.end() );
+        outline.insert( outline.end(), blob.right.rbegin(), blob.right.rend() );
+        cv::approxPolyDP( outline, shape.hull, 3, true );
+        shape.position = blob.position * ( 1.0f / blob.pixels );
+        double meanZ = blob.sumZ / blob.pixels;
+        shape.depthDeviation = (float)sqrt( max( blob.sumZ2 / blob.pixels - meanZ * meanZ, 0.0 ) );
+        // height of the tallest point, footprint as seen from above
+        shape.height = blob.top * 0.001f;
+        shape.footprint = blob.cells * mParams.cellSize * mParams.cellSize;
+        shapes.push_back( shape );
+    }
+    return shapes;
+}
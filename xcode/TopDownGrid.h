@@ -0,0 +1,65 @@
+//
+//  TopDownGrid.h
+//  MotionTrackingTest
+//
+//  Finds people by where they stand rather than by image contours, so people
+//  touching in the image still come out as separate shapes. Foreground depth
+//  pixels are scattered onto a grid laid on the floor plane, each cell
+//  keeping the tallest point above it. Blobs of cells taller than a cut
+//  height are labelled, and every foreground pixel is credited to the blob
+//  its cell belongs to for the image-space parts of the shape: centroid,
+//  box, an outline traced from the ends of each row and the depth spread.
+//
+//  Per-pixel tables turn a depth straight into grid column and row, so the
+//  scatter is two multiply-adds and a max per pixel.
+//
+
+#pragma once
+#include "FloorPlane.h"
+#include "Shape.h"
+
+#include <vector>
+
+class TopDownGrid {
+public:
+    struct Params {
+        Params();
+
+        // metres; the grid runs width across and depth away from the camera,
+        // from its foot or from the nearest floor it sees behind that
+        float cellSize;
+        float width;
+        float depth;
+        // smaller blobs are noise
+        int minCells;
+    };
+
+    explicit TopDownGrid( const Params &params = Params() );
+
+    // shapes for the set pixels of foreground, which must have usable depth;
+    // cutHeight in millimetres above the floor, minArea in image pixels
+    std::vector<Shape> detect( const cv::Mat &depth, const cv::Mat &foreground, const DepthProjector &projector, const FloorPlane &floor, float cutHeight, int minArea );
+
+    // tallest point above each cell in millimetres, for display
+    const cv::Mat& getHeights() const { return mHeights; }
+
+private:
+    void buildTables( const DepthProjector &projector, const FloorPlane &floor );
+
+    Params mParams;
+    int mColumns;
+    int mRows;
+    uint32_t mFloorRevision;
+
+    // depth in mm times these gives grid column and row, before offsets
+    cv::Mat mColumnScale;
+    cv::Mat mRowScale;
+    float mRowOffset;
+
+    cv::Mat mHeights;
+    // grid cell of every pixel, -1 when it was not scattered
+    cv::Mat mPixelCells;
+    cv::Mat mOccupied;
+    cv::Mat mLabels;
+    std::vector< std::vector<cv::Point> > mContours;
+};
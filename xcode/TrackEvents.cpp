@@ -0,0 +1,373 @@
+//
+//  TrackEvents.cpp
+//  MotionTrackingTest
+//
+
+#include "TrackEvents.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+    const char MAGIC[4] = { 'M', 'T', 'E', 'V' };
+    const uint16_t VERSION = 1;
+    const size_t HEADER_SIZE = 40;
+    const size_t EVENT_SIZE = TrackEvent::ENCODED_SIZE;
+    // keep datagrams under a typical MTU so UDP never fragments
+    const size_t MAX_PACKET_SIZE = 1400;
+    const size_t EVENTS_PER_PACKET = ( MAX_PACKET_SIZE - HEADER_SIZE ) / EVENT_SIZE;
+
+    const char* sTypeNames[] = { "enter", "update", "exit" };
+
+    template<typename T>
+    uint8_t* put( uint8_t* out, T value ){
+        // the wire format is little-endian, as are all our targets
+        memcpy( out, &value, sizeof( T ) );
+        return out + sizeof( T );
+    }
+
+    template<typename T>
+    const uint8_t* get( const uint8_t* in, T &value ){
+        memcpy( &value, in, sizeof( T ) );
+        return in + sizeof( T );
+    }
+
+    int16_t clamp16( int value ){
+        return (int16_t)std::max( -32768, std::min( 32767, value ) );
+    }
+}
+
+TrackEvent TrackEvent::fromShape( Type type, const Shape &shape ){
+    TrackEvent event;
+    event.type = type;
+    event.ID = shape.ID;
+    event.x = shape.centroid.x;
+    event.y = shape.centroid.y;
+    event.area = shape.area;
+    event.vx = shape.velocity.x;
+    event.vy = shape.velocity.y;
+    event.bx = clamp16( shape.boundingRect.x );
+    event.by = clamp16( shape.boundingRect.y );
+    event.bw = clamp16( shape.boundingRect.width );
+    event.bh = clamp16( shape.boundingRect.height );
+    return event;
+}
+
+uint8_t* TrackEvent::encode( uint8_t* out ) const {
+    out = put<uint8_t>( out, type );
+    memset( out, 0, 3 );
+    out += 3;
+    out = put<int32_t>( out, ID );
+    out = put<float>( out, x );
+    out = put<float>( out, y );
+    out = put<float>( out, area );
+    out = put<float>( out, vx );
+    out = put<float>( out, vy );
+    out = put<int16_t>( out, bx );
+    out = put<int16_t>( out, by );
+    out = put<int16_t>( out, bw );
+    out = put<int16_t>( out, bh );
+    return out;
+}
+
+const uint8_t* TrackEvent::decode( const uint8_t* in ){
+    in = get( in, type );
+    in += 3;
+    in = get( in, ID );
+    in = get( in, x );
+    in = get( in, y );
+    in = get( in, area );
+    in = get( in, vx );
+    in = get( in, vy );
+    in = get( in, bx );
+    in = get( in, by );
+    in = get( in, bw );
+    in = get( in, bh );
+    return in;
+}
+
+TrackEventSender::TrackEventSender() :
+mSocket(-1),
+mFormat(FORMAT_BINARY),
+mFrameNumber(0),
+mSequence(0),
+mDepthTimestamp(0),
+mCaptureTime(0)
+{
+}
+
+TrackEventSender::~TrackEventSender(){
+    close();
+}
+
+uint64_t TrackEventSender::hostTimeMicros(){
+    return std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+bool TrackEventSender::openUdp( const std::string &host, int port, Format format ){
+    close();
+
+    sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( port );
+    if( inet_pton( AF_INET, host.c_str(), &addr.sin_addr ) != 1 ){
+        MT_LOG_ERROR( "track events: bad UDP host" );
+        return false;
+    }
+
+    mSocket = socket( AF_INET, SOCK_DGRAM, 0 );
+    if( mSocket < 0 ){
+        MT_LOG_ERROR( "track events: socket() failed, errno", errno );
+        return false;
+    }
+    // a slow or missing receiver must never stall the depth thread
+    fcntl( mSocket, F_SETFL, fcntl( mSocket, F_GETFL ) | O_NONBLOCK );
+
+    mAddress.assign( (uint8_t*)&addr, (uint8_t*)&addr + sizeof( addr ) );
+    mFormat = format;
+    return true;
+}
+
+bool TrackEventSender::openUnix( const std::string &path, Format format ){
+    close();
+
+    sockaddr_un addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    if( path.size() >= sizeof( addr.sun_path ) ){
+        MT_LOG_ERROR( "track events: Unix socket path too long" );
+        return false;
+    }
+    strncpy( addr.sun_path, path.c_str(), sizeof( addr.sun_path ) - 1 );
+
+    mSocket = socket( AF_UNIX, SOCK_DGRAM, 0 );
+    if( mSocket < 0 ){
+        MT_LOG_ERROR( "track events: socket() failed, errno", errno );
+        return false;
+    }
+    fcntl( mSocket, F_SETFL, fcntl( mSocket, F_GETFL ) | O_NONBLOCK );
+
+    mAddress.assign( (uint8_t*)&addr, (uint8_t*)&addr + sizeof( addr ) );
+    mFormat = format;
+    return true;
+}
+
+void TrackEventSender::close(){
+    if( mSocket >= 0 ){
+        ::close( mSocket );
+        mSocket = -1;
+    }
+}
+
+void TrackEventSender::sendFrame( uint64_t depthTimestamp, uint64_t captureTime, const std::vector<TrackEvent> &events ){
+    if( mSocket < 0 ){
+        return;
+    }
+    mDepthTimestamp = depthTimestamp;
+    mCaptureTime = captureTime;
+
+    // always send at least one packet so receivers see every frame
+    size_t first = 0;
+    do {
+        size_t count = std::min( EVENTS_PER_PACKET, events.size() - first );
+        size_t size = mFormat == FORMAT_BINARY ? encodeBinary( events.data() + first, count, mSequence ) : encodeJson( events.data() + first, count, mSequence );
+        mSequence++;
+        if( sendto( mSocket, mBuffer.data(), size, 0, (const sockaddr*)mAddress.data(), mAddress.size() ) < 0 && errno != EAGAIN ){
+            MT_LOG_DEBUG( "track events: sendto failed, errno", errno );
+        }
+        first += count;
+    } while( first < events.size() );
+
+    mFrameNumber++;
+}
+
+size_t TrackEventSender::encodeBinary( const TrackEvent* events, size_t count, uint32_t sequence ){
+    mBuffer.resize( HEADER_SIZE + count * EVENT_SIZE );
+    uint8_t* out = mBuffer.data();
+
+    memcpy( out, MAGIC, 4 );
+    out += 4;
+    out = put<uint16_t>( out, VERSION );
+    out = put<uint16_t>( out, count );
+    out = put<uint32_t>( out, mFrameNumber );
+    out = put<uint32_t>( out, sequence );
+    out = put<uint64_t>( out, mDepthTimestamp );
+    out = put<uint64_t>( out, mCaptureTime );
+    out = put<uint64_t>( out, hostTimeMicros() );
+
+    for( size_t i = 0; i < count; i++ ){
+        out = events[i].encode( out );
+    }
+    return out - mBuffer.data();
+}
+
+size_t TrackEventSender::encodeJson( const TrackEvent* events, size_t count, uint32_t sequence ){
+    char item[256];
+    mBuffer.clear();
+
+    int length = snprintf( item, sizeof( item ), "{\"frame\":%u,\"seq\":%u,\"depthTs\":%llu,\"captureUs\":%llu,\"sendUs\":%llu,\"events\":[",
+                          mFrameNumber, sequence, (unsigned long long)mDepthTimestamp, (unsigned long long)mCaptureTime, (unsigned long long)hostTimeMicros() );
+    mBuffer.insert( mBuffer.end(), item, item + length );
+
+    for( size_t i = 0; i < count; i++ ){
+        const TrackEvent &e = events[i];
+        length = snprintf( item, sizeof( item ), "%s{\"type\":\"%s\",\"id\":%d,\"x\":%.1f,\"y\":%.1f,\"area\":%.1f,\"vx\":%.1f,\"vy\":%.1f,\"bbox\":[%d,%d,%d,%d]}",
+                          i > 0 ? "," : "", sTypeNames[e.type], e.ID, e.x, e.y, e.area, e.vx, e.vy, e.bx, e.by, e.bw, e.bh );
+        mBuffer.insert( mBuffer.end(), item, item + length );
+    }
+    mBuffer.push_back( ']' );
+    mBuffer.push_back( '}' );
+    return mBuffer.size();
+}
+
+TrackEventReceiver::TrackEventReceiver() :
+mSocket(-1),
+mHasSequence(false),
+mLastSequence(0),
+mSendLatencySumMs(0),
+mReceiveLatencySumMs(0)
+{
+    memset( &mStats, 0, sizeof( mStats ) );
+    mBuffer.resize( 65536 );
+}
+
+TrackEventReceiver::~TrackEventReceiver(){
+    close();
+}
+
+bool TrackEventReceiver::bindUdp( int port ){
+    close();
+
+    sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( port );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+    mSocket = socket( AF_INET, SOCK_DGRAM, 0 );
+    if( mSocket < 0 || bind( mSocket, (const sockaddr*)&addr, sizeof( addr ) ) < 0 ){
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool TrackEventReceiver::bindUnix( const std::string &path ){
+    close();
+
+    sockaddr_un addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    if( path.size() >= sizeof( addr.sun_path ) ){
+        return false;
+    }
+    strncpy( addr.sun_path, path.c_str(), sizeof( addr.sun_path ) - 1 );
+    unlink( path.c_str() );
+
+    mSocket = socket( AF_UNIX, SOCK_DGRAM, 0 );
+    if( mSocket < 0 || bind( mSocket, (const sockaddr*)&addr, sizeof( addr ) ) < 0 ){
+        close();
+        return false;
+    }
+    mUnixPath = path;
+    return true;
+}
+
+void TrackEventReceiver::close(){
+    if( mSocket >= 0 ){
+        ::close( mSocket );
+        mSocket = -1;
+    }
+    if( ! mUnixPath.empty() ){
+        unlink( mUnixPath.c_str() );
+        mUnixPath.clear();
+    }
+}
+
+bool TrackEventReceiver::receive( std::vector<TrackEvent> &events, int timeoutMs ){
+    if( mSocket < 0 ){
+        return false;
+    }
+
+    pollfd pfd;
+    pfd.fd = mSocket;
+    pfd.events = POLLIN;
+    if( poll( &pfd, 1, timeoutMs ) <= 0 ){
+        return false;
+    }
+
+    ssize_t size = recv( mSocket, mBuffer.data(), mBuffer.size(), 0 );
+    if( size <= 0 ){
+        return false;
+    }
+    return decode( mBuffer.data(), size, events );
+}
+
+bool TrackEventReceiver::decode( const uint8_t* data, size_t size, std::vector<TrackEvent> &events ){
+    uint64_t receiveTime = TrackEventSender::hostTimeMicros();
+
+    uint16_t version, count;
+    uint32_t frameNumber, sequence;
+    uint64_t depthTimestamp, captureTime, sendTime;
+    if( size < HEADER_SIZE || memcmp( data, MAGIC, 4 ) != 0 ){
+        mStats.malformed++;
+        return false;
+    }
+    const uint8_t* in = data + 4;
+    in = get( in, version );
+    in = get( in, count );
+    in = get( in, frameNumber );
+    in = get( in, sequence );
+    in = get( in, depthTimestamp );
+    in = get( in, captureTime );
+    in = get( in, sendTime );
+    if( version != VERSION || size != HEADER_SIZE + count * EVENT_SIZE ){
+        mStats.malformed++;
+        return false;
+    }
+
+    // ordering: every packet carries the next sequence number
+    if( mHasSequence ){
+        int32_t delta = (int32_t)( sequence - mLastSequence );
+        if( delta <= 0 ){
+            mStats.reordered++;
+        } else {
+            mStats.gaps += delta - 1;
+            mLastSequence = sequence;
+        }
+    } else {
+        mLastSequence = sequence;
+        mHasSequence = true;
+    }
+
+    for( uint16_t i = 0; i < count; i++ ){
+        TrackEvent e;
+        in = e.decode( in );
+        events.push_back( e );
+    }
+
+    double sendLatencyMs = ( sendTime - captureTime ) / 1000.0;
+    double receiveLatencyMs = ( receiveTime - captureTime ) / 1000.0;
+    mStats.packets++;
+    mStats.events += count;
+    mSendLatencySumMs += sendLatencyMs;
+    mReceiveLatencySumMs += receiveLatencyMs;
+    mStats.meanSendLatencyMs = mSendLatencySumMs / mStats.packets;
+    mStats.meanReceiveLatencyMs = mReceiveLatencySumMs / mStats.packets;
+    mStats.maxSendLatencyMs = std::max( mStats.maxSendLatencyMs, sendLatencyMs );
+    mStats.maxReceiveLatencyMs = std::max( mStats.maxReceiveLatencyMs, receiveLatencyMs );
+    return true;
+}
@@ -0,0 +1,124 @@
+//
+//  TrackEvents.h
+//  MotionTrackingTest
+//
+//  Track enter / update / exit events streamed to show control over a local
+//  datagram socket (UDP or Unix), batched into one packet per depth frame.
+//
+//  Binary packets are little-endian:
+//    header  magic "MTEV", u16 version, u16 event count, u32 frame number,
+//            u32 packet sequence, u64 depth timestamp (sensor us),
+//            u64 capture time and u64 send time (host monotonic us)
+//    event   u8 type, 3 pad bytes, i32 ID, f32 centroid x/y, f32 area,
+//            f32 velocity x/y (px/s), i16 bbox x/y/width/height
+//  Frames with more events than fit in one datagram are split across
+//  consecutive packets sharing the frame number.
+//
+
+#pragma once
+#include "Shape.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// one track's state as carried on the wire
+struct TrackEvent {
+    enum Type {
+        ENTER = 0,
+        UPDATE,
+        EXIT
+    };
+
+    static const size_t ENCODED_SIZE = 36;
+
+    static TrackEvent fromShape( Type type, const Shape &shape );
+
+    // fixed-size little-endian encoding shared by the socket stream and recordings
+    uint8_t* encode( uint8_t* out ) const;
+    const uint8_t* decode( const uint8_t* in );
+
+    uint8_t type;
+    int32_t ID;
+    float x, y;
+    float area;
+    float vx, vy;
+    int16_t bx, by, bw, bh;
+};
+
+class TrackEventSender {
+public:
+    enum Format {
+        FORMAT_BINARY = 0,
+        FORMAT_JSON
+    };
+
+    TrackEventSender();
+    ~TrackEventSender();
+
+    bool openUdp( const std::string &host, int port, Format format = FORMAT_BINARY );
+    bool openUnix( const std::string &path, Format format = FORMAT_BINARY );
+    void close();
+    bool isOpen() const { return mSocket >= 0; }
+
+    // captureTime is the host monotonic time the depth frame arrived
+    void sendFrame( uint64_t depthTimestamp, uint64_t captureTime, const std::vector<TrackEvent> &events );
+
+    static uint64_t hostTimeMicros();
+
+private:
+    size_t encodeBinary( const TrackEvent* events, size_t count, uint32_t sequence );
+    size_t encodeJson( const TrackEvent* events, size_t count, uint32_t sequence );
+
+    int mSocket;
+    Format mFormat;
+    std::vector<uint8_t> mAddress;
+
+    uint32_t mFrameNumber;
+    uint32_t mSequence;
+    uint64_t mDepthTimestamp;
+    uint64_t mCaptureTime;
+    std::vector<uint8_t> mBuffer;
+};
+
+// decodes binary packets, checks ordering and measures delivery latency
+class TrackEventReceiver {
+public:
+    struct Stats {
+        uint64_t packets;
+        uint64_t events;
+        uint64_t malformed;
+        // sequence numbers skipped, or arriving behind one already seen
+        uint64_t gaps;
+        uint64_t reordered;
+        // on the host monotonic clock: depth frame arrival -> packet send,
+        // and depth frame arrival -> packet receive
+        double meanSendLatencyMs;
+        double maxSendLatencyMs;
+        double meanReceiveLatencyMs;
+        double maxReceiveLatencyMs;
+    };
+
+    TrackEventReceiver();
+    ~TrackEventReceiver();
+
+    bool bindUdp( int port );
+    bool bindUnix( const std::string &path );
+    void close();
+
+    // waits up to timeoutMs for a packet and appends its events
+    bool receive( std::vector<TrackEvent> &events, int timeoutMs );
+    bool decode( const uint8_t* data, size_t size, std::vector<TrackEvent> &events );
+
+    const Stats& getStats() const { return mStats; }
+
+private:
+    int mSocket;
+    std::string mUnixPath;
+    bool mHasSequence;
+    uint32_t mLastSequence;
+    double mSendLatencySumMs;
+    double mReceiveLatencySumMs;
+    Stats mStats;
+    std::vector<uint8_t> mBuffer;
+};
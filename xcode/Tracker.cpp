@@ -0,0 +1,975 @@
+//
+//  Tracker.cpp
+//  MotionTrackingTest
+//
+
+#include "Tracker.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace {
+    const int MOTION_TILE = 16;
+    // matched tracks refresh their appearance every this many frames
+    const int APPEARANCE_INTERVAL = 5;
+    // tiles are sampled on every fourth row
+    const int MOTION_ROW_STEP = 4;
+    // per-pixel differences are capped so dropouts flickering to 0 count as
+    // an ordinary change rather than swamping a tile
+    const int MOTION_CAP = 255;
+
+    // true once any tile's mean absolute difference over its sampled pixels
+    // exceeds threshold millimetres; columns past the last whole tile are not
+    // compared
+    bool sceneChanged( const cv::Mat &a, const cv::Mat &b, float threshold ){
+        const int samples = MOTION_TILE * ( MOTION_TILE / MOTION_ROW_STEP );
+        const int limit = (int)( threshold * samples );
+        const int tilesAcross = a.cols / MOTION_TILE;
+        for( int ty = 0; ty + MOTION_TILE <= a.rows; ty += MOTION_TILE ){
+            for( int tx = 0; tx < tilesAcross; tx++ ){
+                int x0 = tx * MOTION_TILE;
+                int sad = 0;
+#if defined( __SSE2__ )
+                const __m128i cap = _mm_set1_epi16( MOTION_CAP );
+                __m128i sum = _mm_setzero_si128();
+                for( int y = ty; y < ty + MOTION_TILE; y += MOTION_ROW_STEP ){
+                    const __m128i* pa = (const __m128i*)( a.ptr<uint16_t>( y ) + x0 );
+                    const __m128i* pb = (const __m128i*)( b.ptr<uint16_t>( y ) + x0 );
+                    for( int i = 0; i < MOTION_TILE / 8; i++ ){
+                        __m128i va = _mm_loadu_si128( pa + i );
+                        __m128i vb = _mm_loadu_si128( pb + i );
+                        __m128i diff = _mm_or_si128( _mm_subs_epu16( va, vb ), _mm_subs_epu16( vb, va ) );
+                        // min( diff, cap ) without an unsigned 16-bit min
+                        sum = _mm_add_epi16( sum, _mm_sub_epi16( diff, _mm_subs_epu16( diff, cap ) ) );
+                    }
+                }
+                // at most 8 capped values per lane, so lanes fit in 16 bits
+                __m128i pairs = _mm_madd_epi16( sum, _mm_set1_epi16( 1 ) );
+                pairs = _mm_add_epi32( pairs, _mm_srli_si128( pairs, 8 ) );
+                pairs = _mm_add_epi32( pairs, _mm_srli_si128( pairs, 4 ) );
+                sad = _mm_cvtsi128_si32( pairs );
+#else
+                for( int y = ty; y < ty + MOTION_TILE; y += MOTION_ROW_STEP ){
+                    const uint16_t* pa = a.ptr<uint16_t>( y ) + x0;
+                    const uint16_t* pb = b.ptr<uint16_t>( y ) + x0;
+                    for( int x = 0; x < MOTION_TILE; x++ ){
+                        sad += std::min( std::abs( pa[x] - pb[x] ), MOTION_CAP );
+                    }
+                }
+#endif
+                if( sad > limit ){
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool byCentroidX( const Shape &a, const Shape &b ){
+        return a.centroid.x < b.centroid.x;
+    }
+
+    bool byID( const Shape &a, const Shape &b ){
+        return a.ID < b.ID;
+    }
+
+    // matchShapes' second method over cached signatures
+    float huDistance( const cv::Vec<float, 7> &a, const cv::Vec<float, 7> &b ){
+        float sum = 0.0f;
+        for( int i = 0; i < 7; i++ ){
+            sum += std::abs( a[i] - b[i] );
+        }
+        return sum;
+    }
+}
+
+Tracker::Params::Params() :
+thresh(0.0),
+maxVal(255.0),
+nearLimit(30),
+farLimit(4000),
+minArea(75),
+maxArea(100000),
+maxMatchDistance(5000),
+maxMatchMetres(0.75f),
+horizontalFov(1.0144f),
+verticalFov(0.7898f),
+floorSegmentation(true),
+minHeight(300.0f),
+maxHeight(2500.0f),
+floorMaxTilt(60.0f),
+topDownGrid(false),
+gridCutHeight(800.0f),
+splitArea(5000),
+splitPeakRatio(0.5f),
+trackHeads(false),
+headBand(150.0f),
+motionThreshold(15.0f),
+motionRefreshFrames(30),
+idleAfterMs(10000),
+idleCheckInterval(3),
+roiTracking(false),
+fullScanInterval(10),
+roiMargin(16),
+opticalFlow(false),
+flowFromColor(false),
+adaptiveGating(true),
+minGateMetres(0.3f),
+gateGrowth(1.5f),
+reidentify(false),
+reidMaxAgeMs(30000),
+reidMaxDistance(0.2f),
+personThreshold(0.5f),
+shapeWeight(0.0f),
+trackExpiryMs(333)
+{
+}
+
+Tracker::IdleStats::IdleStats() :
+idlePeriods(0),
+idleMicros(0),
+skippedFrames(0),
+lastWakeLatencyMs(0.0f)
+{
+}
+
+Tracker::Tracker() :
+shapeUID(0),
+mStaticFrames(0),
+mStatic(false),
+mIdle(false),
+mIdleFrames(0),
+mLastActiveTimestamp(0),
+mIdleSince(0),
+mLastIdleCheck(0),
+mFramesSinceScan(0),
+mFrameCount(0),
+mPendingFlowTimestamp(0),
+mFlowImageSupplied(false),
+mFlowFromColor(false),
+mCandidatesPerTrack(0.0f)
+{
+}
+
+void Tracker::setParams( const Params &params ){
+    std::lock_guard<std::mutex> lock( mParamsMutex );
+    mPendingParams = params;
+}
+
+Tracker::Params Tracker::getParams(){
+    std::lock_guard<std::mutex> lock( mParamsMutex );
+    return mPendingParams;
+}
+
+bool Tracker::loadClassifier( const string &path ){
+    return mClassifier.load( path );
+}
+
+void Tracker::reset(){
+    shapeUID = 0;
+    mTrackedShapes.clear();
+    mShapes.clear();
+    mEvents.clear();
+    mPreviousFrame.release();
+    mStaticFrames = 0;
+    mStatic = false;
+    mIdle = false;
+    mLastActiveTimestamp = 0;
+    mFramesSinceScan = 0;
+    mFloor.reset();
+    mFlow.reset();
+    mReidentifier.reset();
+}
+
+void Tracker::process( const cv::Mat &depth, uint64_t timestamp ){
+    {
+        std::lock_guard<std::mutex> lock( mParamsMutex );
+        mParams = mPendingParams;
+    }
+    mEvents.clear();
+    mInput = depth;
+    mFrameCount++;
+    if( skipWhileIdle( timestamp ) ){
+        return;
+    }
+    // a static scene keeps the last segmentation and shapes and only runs
+    // matching again, which keeps its tracks alive
+    if( isStatic() ){
+        for( Shape &shape : mShapes ){
+            shape.matchFound = false;
+        }
+    } else if( mParams.roiTracking && ! mTrackedShapes.empty() && ! mForeground.empty()
+        && mFramesSinceScan + 1 < mParams.fullScanInterval && mProjector.matches( mInput.cols, mInput.rows, mParams.horizontalFov, mParams.verticalFov ) ){
+        // tracks are followed locally, a full scan every fullScanInterval
+        // frames picks up new entrants
+        mFramesSinceScan++;
+        segmentTracked( timestamp );
+    } else {
+        segment();
+    }
+
+    // shapes sorted across the image, so each track only checks the ones
+    // inside its pixel window
+    std::sort( mShapes.begin(), mShapes.end(), byCentroidX );
+    int candidates = 0;
+
+    // find the nearest match for each shape
+    for( int i = 0; i<mTrackedShapes.size(); i++ ){
+        cv::Point centroid = mTrackedShapes[i].centroid;
+        cv::Point3f position = mTrackedShapes[i].position;
+        if( mParams.opticalFlow ){
+            predict( mTrackedShapes[i], timestamp, centroid, position );
+        }
+        float gateMetres, gatePixels;
+        gate( mTrackedShapes[i], timestamp, position, gateMetres, gatePixels );
+        Shape* nearestShape = findNearestMatch( centroid, position, mTrackedShapes[i], mShapes, gatePixels, gateMetres, candidates );
+
+        if( nearestShape != NULL){
+            // update our tracked contour
+            // last frame seen
+            nearestShape->matchFound = true;
+            float dt = ( timestamp - mTrackedShapes[i].lastSeenTimestamp ) / 1.0e6f;
+            if( dt > 0 ){
+                cv::Point motion = nearestShape->centroid - mTrackedShapes[i].centroid;
+                mTrackedShapes[i].velocity = cv::Point2f( motion.x / dt, motion.y / dt );
+            }
+            mTrackedShapes[i].centroid = nearestShape->centroid;
+            mTrackedShapes[i].area = nearestShape->area;
+            mTrackedShapes[i].boundingRect = nearestShape->boundingRect;
+            mTrackedShapes[i].position = nearestShape->position;
+            mTrackedShapes[i].height = nearestShape->height;
+            mTrackedShapes[i].footprint = nearestShape->footprint;
+            mTrackedShapes[i].depthDeviation = nearestShape->depthDeviation;
+            mTrackedShapes[i].hu = nearestShape->hu;
+            mTrackedShapes[i].huValid = nearestShape->huValid;
+            mTrackedShapes[i].lastSeenTimestamp = timestamp;
+            mTrackedShapes[i].hull.clear();
+            mTrackedShapes[i].hull = nearestShape->hull;
+            // the remembered appearance follows slowly, sampled every few frames
+            if( mParams.reidentify && ( ! mTrackedShapes[i].appearance.valid || ( mTrackedShapes[i].ID + mFrameCount ) % APPEARANCE_INTERVAL == 0 ) ){
+                computeAppearance( *nearestShape );
+                Appearance &kept = mTrackedShapes[i].appearance;
+                const Appearance &seen = nearestShape->appearance;
+                if( seen.valid && kept.valid ){
+                    for( int v = 0; v < Appearance::SIZE; v++ ){
+                        kept.values[v] = kept.values[v] * 0.8f + seen.values[v] * 0.2f;
+                    }
+                } else if( seen.valid ){
+                    kept = seen;
+                }
+            }
+            mEvents.push_back( TrackEvent::fromShape( TrackEvent::UPDATE, mTrackedShapes[i] ) );
+        }
+    }
+
+    if( ! mTrackedShapes.empty() ){
+        float perTrack = (float)candidates / mTrackedShapes.size();
+        mCandidatesPerTrack = mCandidatesPerTrack + ( perTrack - mCandidatesPerTrack ) * 0.05f;
+    }
+
+    ReIdentifier::Params reidParams;
+    reidParams.maxAgeMicros = (uint64_t)mParams.reidMaxAgeMs * 1000;
+    reidParams.maxDistance = mParams.reidMaxDistance;
+    reidParams.minMetres = mParams.minGateMetres;
+    reidParams.metresPerSecond = mParams.gateGrowth;
+    mReidentifier.setParams( reidParams );
+
+    // if shape->matchFound is false, add it as a new shape, under its old ID
+    // if it looks like a track lost recently
+    for( int i = 0; i<mShapes.size(); i++ ){
+        if( mShapes[i].matchFound == false ){
+            int ID = -1;
+            if( mParams.reidentify ){
+                computeAppearance( mShapes[i] );
+                ID = mReidentifier.find( mShapes[i], timestamp );
+            }
+            if( ID >= 0 ){
+                MT_LOG_INFO( "tracker: re-identified lost track", ID );
+                mShapes[i].ID = ID;
+            } else {
+                mShapes[i].ID = shapeUID;
+                shapeUID++;
+            }
+            mShapes[i].lastSeenTimestamp = timestamp;
+            // a re-identified ID is older than the newest tracks, and
+            // consumers like the trajectory log rely on ascending IDs
+            mTrackedShapes.insert( std::upper_bound( mTrackedShapes.begin(), mTrackedShapes.end(), mShapes[i], byID ), mShapes[i] );
+            mEvents.push_back( TrackEvent::fromShape( TrackEvent::ENTER, mShapes[i] ) );
+        }
+    }
+
+    // if we didnt find a match for x milliseconds, delete the tracked shape
+    uint64_t expiry = (uint64_t)mParams.trackExpiryMs * 1000;
+    for( vector<Shape>::iterator it=mTrackedShapes.begin(); it!=mTrackedShapes.end(); ){
+        if( timestamp - it->lastSeenTimestamp > expiry ){
+            mEvents.push_back( TrackEvent::fromShape( TrackEvent::EXIT, *it ) );
+            if( mParams.reidentify ){
+                mReidentifier.lose( *it, timestamp );
+            }
+            it = mTrackedShapes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if( mParams.opticalFlow ){
+        updateFlow( timestamp );
+    }
+
+    // go idle once the scene has had no tracks for long enough
+    if( ! mTrackedShapes.empty() || mLastActiveTimestamp == 0 || timestamp < mLastActiveTimestamp ){
+        mLastActiveTimestamp = timestamp;
+    } else if( mParams.idleAfterMs > 0 && mParams.motionThreshold > 0.0f && timestamp - mLastActiveTimestamp > (uint64_t)mParams.idleAfterMs * 1000 ){
+        mIdle = true;
+        mIdleFrames = 0;
+        mIdleSince = timestamp;
+        mLastIdleCheck = timestamp;
+        IdleStats stats;
+        {
+            std::lock_guard<std::mutex> lock( mIdleStatsMutex );
+            mIdleStats.idlePeriods++;
+            stats = mIdleStats;
+        }
+        MT_LOG_INFO( "tracker: idle, no tracks for ms, idle periods, idle s so far, skipped frames", mParams.idleAfterMs, stats.idlePeriods, stats.idleMicros / 1.0e6f, stats.skippedFrames );
+    }
+}
+
+void Tracker::segment(){
+    // fresh buffers every frame, so callers can keep the previous ones
+    mEightBit = cv::Mat();
+    mForeground = cv::Mat();
+
+    mWithoutBlack = removeBlack( mInput, mParams.nearLimit, mParams.farLimit );
+
+    // convert to RGB color space, with some compensation
+    mWithoutBlack.convertTo( mEightBit, CV_8UC3, 0.1/1.0  );
+    cv::bitwise_not(mEightBit, mEightBit);
+
+    if( ! mProjector.matches( mInput.cols, mInput.rows, mParams.horizontalFov, mParams.verticalFov ) ){
+        mProjector.setup( mInput.cols, mInput.rows, mParams.horizontalFov, mParams.verticalFov );
+        mFloor.reset();
+    }
+
+    // height above the floor once it has been found, the depth slab until then
+    if( mParams.floorSegmentation ){
+        FloorPlane::Params floorParams = mFloor.getParams();
+        floorParams.maxTilt = mParams.floorMaxTilt;
+        mFloor.setParams( floorParams );
+        mFloor.update( mInput, mProjector, mParams.nearLimit, mParams.farLimit );
+    }
+    cv::Rect frame( 0, 0, mInput.cols, mInput.rows );
+    if( mParams.floorSegmentation && mFloor.isValid() ){
+        mFloor.segment( mInput, frame, mParams.nearLimit, mParams.farLimit, mParams.minHeight, mParams.maxHeight, mForeground );
+    } else {
+        cv::threshold( mEightBit, mForeground, mParams.thresh, mParams.maxVal, CV_8U );
+    }
+    findShapes( vector<cv::Rect>( 1, frame ) );
+    mFramesSinceScan = 0;
+}
+
+// segments only windows around where each track is expected, so the cost
+// follows the number of tracks rather than the image size; the rest of the
+// foreground is left empty and the depth views keep the last full frame
+void Tracker::segmentTracked( uint64_t timestamp ){
+    mForeground = cv::Mat::zeros( mInput.rows, mInput.cols, CV_8UC1 );
+    cv::Rect frame( 0, 0, mInput.cols, mInput.rows );
+
+    // windows around predicted boxes, merged where they overlap so no blob is
+    // found twice
+    vector<cv::Rect> windows;
+    for( const Shape &shape : mTrackedShapes ){
+        float dt = ( timestamp - shape.lastSeenTimestamp ) / 1.0e6f;
+        cv::Rect box = shape.boundingRect + cv::Point( (int)( shape.velocity.x * dt ), (int)( shape.velocity.y * dt ) );
+        int marginX = std::max( mParams.roiMargin, box.width / 2 );
+        int marginY = std::max( mParams.roiMargin, box.height / 2 );
+        cv::Rect window = cv::Rect( box.x - marginX, box.y - marginY, box.width + marginX * 2, box.height + marginY * 2 ) & frame;
+        for( bool merged = true; merged; ){
+            merged = false;
+            for( vector<cv::Rect>::iterator it = windows.begin(); it != windows.end(); ++it ){
+                if( ( *it & window ).area() > 0 ){
+                    window |= *it;
+                    windows.erase( it );
+                    merged = true;
+                    break;
+                }
+            }
+        }
+        if( window.area() > 0 ){
+            windows.push_back( window );
+        }
+    }
+
+    bool floor = mParams.floorSegmentation && mFloor.isValid();
+    int thresh = (int)mParams.thresh;
+    uint8_t maxVal = cv::saturate_cast<uint8_t>( mParams.maxVal );
+    for( const cv::Rect &window : windows ){
+        if( floor ){
+            mFloor.segment( mInput, window, mParams.nearLimit, mParams.farLimit, mParams.minHeight, mParams.maxHeight, mForeground );
+            continue;
+        }
+        // removeBlack, the 8-bit conversion and threshold of segment() in one pass
+        for( int y = window.y; y < window.y + window.height; y++ ){
+            const uint16_t* d = mInput.ptr<uint16_t>( y );
+            uint8_t* out = mForeground.ptr( y );
+            for( int x = window.x; x < window.x + window.width; x++ ){
+                int depth = d[x] < mParams.nearLimit || d[x] > mParams.farLimit ? 4000 : d[x];
+                int eightBit = 255 - cv::saturate_cast<uint8_t>( depth * 0.1 );
+                out[x] = eightBit > thresh ? maxVal : 0;
+            }
+        }
+    }
+    findShapes( windows );
+}
+
+// contours and shapes from the foreground inside each of windows
+void Tracker::findShapes( const vector<cv::Rect> &windows ){
+    mContours.clear();
+    mApproxContours.clear();
+    ContourVector found;
+    for( const cv::Rect &window : windows ){
+        // findContours writes into its input
+        cv::Mat thresh = mForeground( window ).clone();
+        cv::findContours( thresh, found, mHierarchy, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE, window.tl() );
+        mContours.insert( mContours.end(), found.begin(), found.end() );
+    }
+
+    vector<cv::Point> approx;
+    // approx number of points per contour
+    for( int i=0; i<mContours.size(); i++ ) {
+        cv::approxPolyDP(mContours[i], approx, 3, true );
+        mApproxContours.push_back( approx );
+    }
+
+    // get data that we can later compare
+    mShapes.clear();
+    if( mParams.topDownGrid && mFloor.isValid() ){
+        mShapes = mGrid.detect( mInput, mForeground, mProjector, mFloor, mParams.gridCutHeight, mParams.minArea );
+    } else {
+        mShapes = getEvaluationSet( mApproxContours, mParams.minArea, mParams.maxArea );
+        splitMerged( mShapes );
+        measureShapes( mShapes );
+    }
+    computeHuMoments( mShapes );
+    classifyShapes( mShapes );
+    if( mParams.trackHeads ){
+        findHeads( mShapes );
+    }
+}
+
+// while idle only every idleCheckInterval-th frame is compared with the last
+// segmented frame, and nothing else runs; the first frame that differs wakes
+// the tracker and is processed in full
+bool Tracker::skipWhileIdle( uint64_t timestamp ){
+    if( ! mIdle ){
+        return false;
+    }
+    bool disabled = mParams.idleAfterMs <= 0 || mParams.motionThreshold <= 0.0f || mPreviousFrame.size() != mInput.size();
+    if( ! disabled ){
+        bool quiet = ++mIdleFrames < mParams.idleCheckInterval;
+        if( ! quiet ){
+            mIdleFrames = 0;
+            quiet = ! sceneChanged( mPreviousFrame, mInput, mParams.motionThreshold );
+            if( quiet ){
+                mLastIdleCheck = timestamp;
+            }
+        }
+        if( quiet ){
+            std::lock_guard<std::mutex> lock( mIdleStatsMutex );
+            mIdleStats.skippedFrames++;
+            return true;
+        }
+    }
+
+    // motion can have started any time after the last quiet check
+    mIdle = false;
+    mLastActiveTimestamp = timestamp;
+    float latencyMs = timestamp >= mLastIdleCheck ? ( timestamp - mLastIdleCheck ) / 1000.0f : 0.0f;
+    {
+        std::lock_guard<std::mutex> lock( mIdleStatsMutex );
+        if( timestamp >= mIdleSince ){
+            mIdleStats.idleMicros += timestamp - mIdleSince;
+        }
+        mIdleStats.lastWakeLatencyMs = latencyMs;
+    }
+    MT_LOG_INFO( "tracker: woke from idle, idle s, wake latency ms", ( timestamp - mIdleSince ) / 1.0e6f, latencyMs );
+    return false;
+}
+
+Tracker::IdleStats Tracker::getIdleStats() const {
+    std::lock_guard<std::mutex> lock( mIdleStatsMutex );
+    return mIdleStats;
+}
+
+// compares against the last segmented frame rather than the previous one, so
+// slow changes still add up to a refresh
+bool Tracker::isStatic(){
+    bool refresh = mParams.motionThreshold <= 0.0f
+        || mPreviousFrame.size() != mInput.size()
+        || ++mStaticFrames >= mParams.motionRefreshFrames
+        || sceneChanged( mPreviousFrame, mInput, mParams.motionThreshold );
+    mStatic = ! refresh;
+    if( refresh ){
+        mPreviousFrame = mInput;
+        mStaticFrames = 0;
+    }
+    return mStatic;
+}
+
+vector< Shape > Tracker::getEvaluationSet( const ContourVector &rawContours, int minimalArea, int maxArea ){
+    vector< Shape > vec;
+    for ( const vector< cv::Point > &c : rawContours )
+    {
+        // create a matrix from the contour
+        cv::Mat matrix = cv::Mat( c );
+
+        // extract data from contour
+        cv::Scalar center = mean( matrix );
+        double area = cv::contourArea( matrix );
+
+        // reject it if too small
+        if ( area < minimalArea )
+            continue;
+
+        // reject it if too big
+        if ( area > maxArea )
+            continue;
+
+        // store data
+        Shape shape;
+        shape.area = area;
+        shape.centroid = cv::Point(center.val[0], center.val[1]);
+        shape.boundingRect = cv::boundingRect( c );
+
+        // convex hull is the polygon enclosing the contour
+        shape.hull = c;
+        MT_LOG_DEBUG( "shape points:", shape.hull.size() );
+        shape.matchFound = false;
+        vec.push_back( shape );
+    }
+    return vec;
+}
+
+// replaces shapes big enough to be several people with the pieces a
+// watershed cuts them into; only these blobs pay for the split
+void Tracker::splitMerged( vector< Shape > &shapes ){
+    if( mParams.splitArea <= 0 ){
+        return;
+    }
+    vector< Shape > pieces;
+    for( vector< Shape >::iterator it = shapes.begin(); it != shapes.end(); ){
+        if( it->area < mParams.splitArea ){
+            ++it;
+            continue;
+        }
+        ContourVector parts = splitShape( *it );
+        if( parts.size() < 2 ){
+            ++it;
+            continue;
+        }
+        vector< Shape > found = getEvaluationSet( parts, mParams.minArea, mParams.maxArea );
+        MT_LOG_DEBUG( "split blob, area, pieces", it->area, found.size() );
+        pieces.insert( pieces.end(), found.begin(), found.end() );
+        it = shapes.erase( it );
+    }
+    shapes.insert( shapes.end(), pieces.begin(), pieces.end() );
+}
+
+// seeds a watershed from the peaks of the shape's distance transform, one per
+// body wide enough to stand out, and floods the depth image between them
+Tracker::ContourVector Tracker::splitShape( const Shape &shape ){
+    ContourVector parts;
+    const cv::Rect &rect = shape.boundingRect;
+    cv::Mat mask = cv::Mat::zeros( rect.size(), CV_8UC1 );
+    const cv::Point* points = shape.hull.data();
+    int count = (int)shape.hull.size();
+    cv::fillPoly( mask, &points, &count, 1, cv::Scalar( 255 ), 8, 0, -rect.tl() );
+
+    cv::Mat dist;
+    cv::distanceTransform( mask, dist, CV_DIST_L2, 3 );
+    double maxDist;
+    cv::minMaxLoc( dist, NULL, &maxDist );
+    cv::Mat peaks;
+    cv::threshold( dist, peaks, maxDist * mParams.splitPeakRatio, 255, CV_THRESH_BINARY );
+    peaks.convertTo( peaks, CV_8U );
+    ContourVector seeds;
+    cv::findContours( peaks, seeds, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE );
+    if( seeds.size() < 2 ){
+        return parts;
+    }
+
+    // outside the shape is a basin of its own so nothing floods out of it
+    int outside = (int)seeds.size() + 1;
+    cv::Mat markers( rect.size(), CV_32SC1, cv::Scalar( outside ) );
+    markers.setTo( 0, mask );
+    for( size_t i = 0; i < seeds.size(); i++ ){
+        cv::drawContours( markers, seeds, (int)i, cv::Scalar( (int)i + 1 ), CV_FILLED );
+    }
+    // the current frame's depth as segment() scales it; mEightBit is only
+    // rebuilt on full scans, so in ROI tracking it can be frames old
+    cv::Mat depth = mInput( rect );
+    cv::Mat eightBit;
+    depth.convertTo( eightBit, CV_8U, 0.1 );
+    eightBit.setTo( 255, ( depth < mParams.nearLimit ) | ( depth > mParams.farLimit ) );
+    cv::bitwise_not( eightBit, eightBit );
+    cv::Mat image;
+    cv::cvtColor( eightBit, image, CV_GRAY2BGR );
+    cv::watershed( image, markers );
+
+    // keep the largest outline of each basin, simplified like the main pass
+    vector<cv::Point> approx;
+    for( int i = 1; i < outside; i++ ){
+        cv::Mat basin = markers == i;
+        ContourVector outlines;
+        cv::findContours( basin, outlines, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE, rect.tl() );
+        int largest = -1;
+        double largestArea = 0.0;
+        for( size_t j = 0; j < outlines.size(); j++ ){
+            double area = cv::contourArea( outlines[j] );
+            if( area > largestArea ){
+                largestArea = area;
+                largest = (int)j;
+            }
+        }
+        if( largest >= 0 ){
+            cv::approxPolyDP( outlines[largest], approx, 3, true );
+            parts.push_back( approx );
+        }
+    }
+    return parts;
+}
+
+// projects each shape's pixels into camera space for its metric position,
+// height and footprint
+void Tracker::measureShapes( vector< Shape > &shapes ){
+    mShapeMask.create( mInput.rows, mInput.cols, CV_8UC1 );
+
+    for( Shape &shape : shapes ){
+        const cv::Rect &rect = shape.boundingRect;
+        cv::Mat mask = mShapeMask( rect );
+        mask.setTo( 0 );
+        const cv::Point* points = shape.hull.data();
+        int count = (int)shape.hull.size();
+        cv::fillPoly( mask, &points, &count, 1, cv::Scalar( 255 ), 8, 0, -rect.tl() );
+
+        DepthProjector::Measurement m = mProjector.measure( mInput, rect, mask, mParams.nearLimit, mParams.farLimit );
+        if( m.pixels > 0 ){
+            shape.position = m.position;
+            shape.height = m.max.y - m.min.y;
+            shape.footprint = m.footprint;
+            shape.depthDeviation = m.depthDeviation;
+        }
+    }
+}
+
+// once per blob per frame; matched tracks keep their shape's copy, so
+// matching compares cached signatures instead of outlines
+void Tracker::computeHuMoments( vector< Shape > &shapes ){
+    double hu[7];
+    for( Shape &shape : shapes ){
+        shape.hu = cv::Vec<float, 7>();
+        shape.huValid = false;
+        if( shape.hull.size() < 3 ){
+            continue;
+        }
+        cv::HuMoments( cv::moments( shape.hull ), hu );
+        for( int i = 0; i < 7; i++ ){
+            // tiny invariants are noise; clamping keeps them at the far end of
+            // the scale rather than at log10(1)
+            double magnitude = std::max( std::abs( hu[i] ), 1.0e-5 );
+            shape.hu[i] = (float)( hu[i] < 0 ? -std::log10( magnitude ) : std::log10( magnitude ) );
+        }
+        shape.huValid = true;
+    }
+}
+
+void Tracker::classifyShapes( vector< Shape > &shapes ){
+    if( ! mClassifier.isLoaded() || mParams.personThreshold <= 0.0f ){
+        return;
+    }
+    for( vector< Shape >::iterator it = shapes.begin(); it != shapes.end(); ){
+        if( mClassifier.score( *it ) < mParams.personThreshold ){
+            MT_LOG_DEBUG( "rejected blob, area, height", it->area, it->height );
+            it = shapes.erase( it );
+        } else {
+            ++it;
+        }
+    }
+}
+
+// for an overhead sensor the head is the part of a blob nearest the camera,
+// and a steadier point to track than the silhouette's centroid; the nearest
+// 4x4 tile filters out single noisy pixels, then the head is the centroid of
+// the pixels near that tile and within headBand of its depth
+void Tracker::findHeads( vector< Shape > &shapes ){
+    const int TILE = 4;
+    // generous head radius, metres
+    const float HEAD_RADIUS = 0.15f;
+
+    for( Shape &shape : shapes ){
+        const cv::Rect &rect = shape.boundingRect;
+        int bestSum = 0, bestCount = 0;
+        cv::Point bestTile;
+        for( int ty = rect.y; ty < rect.y + rect.height; ty += TILE ){
+            for( int tx = rect.x; tx < rect.x + rect.width; tx += TILE ){
+                int sum = 0, count = 0;
+                for( int y = ty; y < std::min( ty + TILE, rect.y + rect.height ); y++ ){
+                    const uint16_t* d = mInput.ptr<uint16_t>( y );
+                    const uint8_t* m = mForeground.ptr( y );
+                    for( int x = tx; x < std::min( tx + TILE, rect.x + rect.width ); x++ ){
+                        if( m[x] && d[x] >= mParams.nearLimit && d[x] <= mParams.farLimit ){
+                            sum += d[x];
+                            count++;
+                        }
+                    }
+                }
+                // half the tile must be usable; compare means without dividing
+                if( count * 2 >= TILE * TILE && ( bestCount == 0 || sum * bestCount < bestSum * count ) ){
+                    bestSum = sum;
+                    bestCount = count;
+                    bestTile = cv::Point( tx + TILE / 2, ty + TILE / 2 );
+                }
+            }
+        }
+        if( bestCount == 0 ){
+            continue;
+        }
+
+        float nearest = (float)bestSum / bestCount;
+        int limit = (int)( nearest + mParams.headBand );
+        int radius = std::max( TILE, (int)( HEAD_RADIUS * mProjector.getFocalLength() * 1000.0f / nearest ) );
+        cv::Rect window = cv::Rect( bestTile.x - radius, bestTile.y - radius, radius * 2 + 1, radius * 2 + 1 ) & rect;
+        int64_t sumX = 0, sumY = 0, sumDepth = 0;
+        int count = 0;
+        for( int y = window.y; y < window.y + window.height; y++ ){
+            const uint16_t* d = mInput.ptr<uint16_t>( y );
+            const uint8_t* m = mForeground.ptr( y );
+            for( int x = window.x; x < window.x + window.width; x++ ){
+                if( m[x] && d[x] >= mParams.nearLimit && d[x] <= limit ){
+                    sumX += x;
+                    sumY += y;
+                    sumDepth += d[x];
+                    count++;
+                }
+            }
+        }
+        if( count == 0 ){
+            continue;
+        }
+        shape.centroid = cv::Point( (int)( sumX / count ), (int)( sumY / count ) );
+        shape.position = mProjector.project( shape.centroid.x, shape.centroid.y, (uint16_t)( sumDepth / count ) );
+    }
+}
+
+void Tracker::setFlowImage( const cv::Mat &gray, uint64_t timestamp ){
+    std::lock_guard<std::mutex> lock( mFlowMutex );
+    mPendingFlowImage = gray;
+    mPendingFlowTimestamp = timestamp;
+    mFlowImageSupplied = true;
+}
+
+// flow needs a new image each frame: with flowFromColor the latest color or
+// IR frame the app supplied, if one arrived since the last frame, otherwise
+// the depth image itself scaled to 8 bits
+void Tracker::updateFlow( uint64_t timestamp ){
+    cv::Mat gray;
+    uint64_t imageTimestamp = timestamp;
+    bool fromColor = false;
+    {
+        std::lock_guard<std::mutex> lock( mFlowMutex );
+        if( mParams.flowFromColor && mFlowImageSupplied ){
+            std::swap( gray, mPendingFlowImage );
+            imageTimestamp = mPendingFlowTimestamp;
+            fromColor = true;
+        }
+    }
+    // features found in one kind of image can't be followed in the other
+    if( fromColor != mFlowFromColor ){
+        mFlow.reset();
+        mFlowFromColor = fromColor;
+    }
+    if( ! fromColor ){
+        mInput.convertTo( gray, CV_8U, 255.0 / std::max<int>( mParams.farLimit, 1 ) );
+    }
+    if( ! gray.empty() ){
+        mFlow.update( gray, imageTimestamp, mInput.size(), timestamp, mTrackedShapes );
+    }
+}
+
+// depth profile of the blob as a normalised histogram: heights between
+// minHeight and maxHeight above the floor when it is known, otherwise depth
+// within a metre behind the blob's nearest point; then its height and
+// footprint, scaled to roughly the same range as a bin
+void Tracker::computeAppearance( Shape &shape ){
+    // depth profile span without a floor, and the height and footprint that
+    // count as 1
+    const float DEPTH_SPAN = 1000.0f;
+    const float HEIGHT_SCALE = 2.5f;
+    const float FOOTPRINT_SCALE = 1.0f;
+
+    Appearance &appearance = shape.appearance;
+    appearance = Appearance();
+    cv::Rect rect = shape.boundingRect & cv::Rect( 0, 0, mInput.cols, mInput.rows );
+    if( rect.area() == 0 || mForeground.size() != mInput.size() ){
+        return;
+    }
+
+    bool floor = mFloor.isValid() && mFloor.getHeightScale().size() == mInput.size();
+    float low, span;
+    if( floor ){
+        low = mParams.minHeight;
+        span = mParams.maxHeight - mParams.minHeight;
+    } else {
+        int nearest = INT_MAX;
+        for( int y = rect.y; y < rect.y + rect.height; y++ ){
+            const uint16_t* d = mInput.ptr<uint16_t>( y );
+            const uint8_t* m = mForeground.ptr( y );
+            for( int x = rect.x; x < rect.x + rect.width; x++ ){
+                if( m[x] && d[x] >= mParams.nearLimit && d[x] <= mParams.farLimit ){
+                    nearest = std::min( nearest, (int)d[x] );
+                }
+            }
+        }
+        if( nearest == INT_MAX ){
+            return;
+        }
+        low = (float)nearest;
+        span = DEPTH_SPAN;
+    }
+    if( span <= 0.0f ){
+        return;
+    }
+
+    float offset = mFloor.getCameraHeight() * 1000.0f;
+    float binsPerMm = Appearance::BINS / span;
+    int count = 0;
+    for( int y = rect.y; y < rect.y + rect.height; y++ ){
+        const uint16_t* d = mInput.ptr<uint16_t>( y );
+        const uint8_t* m = mForeground.ptr( y );
+        const float* scale = floor ? mFloor.getHeightScale().ptr<float>( y ) : NULL;
+        for( int x = rect.x; x < rect.x + rect.width; x++ ){
+            if( m[x] == 0 || d[x] < mParams.nearLimit || d[x] > mParams.farLimit ){
+                continue;
+            }
+            float value = floor ? d[x] * scale[x] + offset : (float)d[x];
+            int bin = (int)( ( value - low ) * binsPerMm );
+            appearance.values[std::min( std::max( bin, 0 ), Appearance::BINS - 1 )] += 1.0f;
+            count++;
+        }
+    }
+    if( count == 0 ){
+        return;
+    }
+    for( int i = 0; i < Appearance::BINS; i++ ){
+        appearance.values[i] /= count;
+    }
+    appearance.values[Appearance::BINS] = shape.height / HEIGHT_SCALE;
+    appearance.values[Appearance::BINS + 1] = shape.footprint / FOOTPRINT_SCALE;
+    appearance.valid = true;
+}
+
+// how far a track can have moved since it was last seen: a floor, plus its
+// speed across the view and an allowance growing with the time unmatched.
+// The pixel window is the metric gate seen at the nearest depth a candidate
+// inside it could have, so far tracks look at few pixels and near ones at many
+void Tracker::gate( const Shape &track, uint64_t timestamp, const cv::Point3f &position, float &metres, float &pixels ){
+    metres = mParams.maxMatchMetres;
+    pixels = mParams.maxMatchDistance;
+    float focal = mProjector.getFocalLength();
+    if( position.z <= 0.0f || focal <= 0.0f ){
+        return;
+    }
+    if( mParams.adaptiveGating ){
+        float dt = timestamp > track.lastSeenTimestamp ? ( timestamp - track.lastSeenTimestamp ) / 1.0e6f : 0.0f;
+        float speed = (float)cv::norm( track.velocity ) * position.z / focal;
+        metres = std::min( mParams.minGateMetres + ( speed + mParams.gateGrowth ) * dt, mParams.maxMatchMetres );
+    }
+    const float CLOSEST = 0.3f;
+    pixels = std::min( pixels, metres * focal / std::max( position.z - metres, CLOSEST ) );
+}
+
+// where a track should be now if it kept its velocity; the metric position
+// moves across the view only, by the pixel motion scaled to its depth
+void Tracker::predict( const Shape &track, uint64_t timestamp, cv::Point &centroid, cv::Point3f &position ){
+    float dt = ( timestamp - track.lastSeenTimestamp ) / 1.0e6f;
+    if( dt <= 0.0f ){
+        return;
+    }
+    cv::Point2f motion = track.velocity * dt;
+    centroid += cv::Point( (int)motion.x, (int)motion.y );
+    if( position.z > 0.0f && mProjector.getFocalLength() > 0.0f ){
+        float metresPerPixel = position.z / mProjector.getFocalLength();
+        position.x += motion.x * metresPerPixel;
+        position.y -= motion.y * metresPerPixel;
+    }
+}
+
+// shapes must be sorted by byCentroidX; candidates outside the pixel window
+// are skipped without being counted in checked
+Shape* Tracker::findNearestMatch( const cv::Point &centroid, const cv::Point3f &position, const Shape &track, vector< Shape > &shapes, float maximumDistance, float maximumMetres, int &checked )
+{
+    Shape* closestShape = NULL;
+    float nearestDist = 1e5;
+    if ( shapes.empty() ){
+        return NULL;
+    }
+
+    Shape left;
+    left.centroid.x = (int)std::max( centroid.x - maximumDistance, (float)INT_MIN );
+    vector< Shape >::iterator first = std::lower_bound( shapes.begin(), shapes.end(), left, byCentroidX );
+
+    bool metric = position.z > 0.0f;
+    for ( vector< Shape >::iterator it = first; it != shapes.end() && it->centroid.x <= centroid.x + maximumDistance; ++it )
+    {
+        Shape &candidate = *it;
+        if ( candidate.matchFound || std::abs( candidate.centroid.y - centroid.y ) > maximumDistance )
+            continue;
+        checked++;
+
+        // distance as a fraction of its gate, so metric and pixel ones compare
+        float dist;
+        if ( metric && candidate.position.z > 0.0f ){
+            cv::Point3f distPoint = position - candidate.position;
+            dist = cv::sqrt( distPoint.dot( distPoint ) ) / maximumMetres;
+        } else {
+            // find dist between the center of the contour and the shape
+            cv::Point distPoint = centroid - candidate.centroid;
+            dist = cv::sqrt( (float)( distPoint.x*distPoint.x + distPoint.y*distPoint.y ) ) / maximumDistance;
+        }
+        if ( dist > 1.0f )
+            continue;
+        // the outline only breaks ties within the gate, it never widens it
+        if ( mParams.shapeWeight > 0.0f && track.huValid && candidate.huValid )
+            dist += mParams.shapeWeight * huDistance( track.hu, candidate.hu );
+
+        if ( dist < nearestDist )
+        {
+            nearestDist = dist;
+            closestShape = &candidate;
+        }
+    }
+    return closestShape;
+}
+
+// returns a copy of input with out-of-range depth pushed to the far value,
+// leaving the raw frame untouched for the depth view and recordings
+cv::Mat Tracker::removeBlack( const cv::Mat &input, short nearLimit, short farLimit )
+{
+    cv::Mat output = input.clone();
+    for( int y=0; y<output.rows; y++ ){
+        for( int x=0; x<output.cols; x++ ){
+            if( output.at<short>(y,x) < nearLimit || output.at<short>(y,x) > farLimit){
+                output.at<short>(y,x) = 4000;
+            }
+        }
+    }
+    return output;
+}
@@ -0,0 +1,225 @@
+//
+//  Tracker.h
+//  MotionTrackingTest
+//
+//  Depth segmentation and shape tracking, independent of the app and the
+//  renderer so the same pipeline runs live, from a recording, or headless.
+//
+
+#pragma once
+#include "Shape.h"
+#include "TrackEvents.h"
+#include "DepthProjector.h"
+#include "FloorPlane.h"
+#include "TopDownGrid.h"
+#include "MotionFlow.h"
+#include "ReIdentifier.h"
+#include "BlobClassifier.h"
+
+#include <atomic>
+#include <mutex>
+
+class Tracker {
+public:
+    typedef std::vector< std::vector<cv::Point> > ContourVector;
+
+    struct Params {
+        Params();
+
+        double thresh;
+        double maxVal;
+        short nearLimit;
+        short farLimit;
+        int minArea;
+        int maxArea;
+        float maxMatchDistance;
+        // used instead of maxMatchDistance when both shapes have a position
+        float maxMatchMetres;
+        // sensor fields of view in radians, as OpenNI and depth recordings
+        // report them, for the metric projection
+        float horizontalFov;
+        float verticalFov;
+        // segment by height above a fitted floor instead of the thresh slab;
+        // heights in millimetres
+        bool floorSegmentation;
+        float minHeight;
+        float maxHeight;
+        // steepest plane taken for the floor, degrees between its normal and
+        // the camera's up axis; a little over 90 for a sensor looking straight
+        // down, so one leaning slightly back still finds it
+        float floorMaxTilt;
+        // find shapes on a top-down floor grid instead of by image contour,
+        // once the floor is known; cells need a point this many mm high
+        bool topDownGrid;
+        float gridCutHeight;
+        // contour blobs at least this big are split by watershed, 0 disables
+        int splitArea;
+        // seeds are where the distance transform exceeds this share of its peak
+        float splitPeakRatio;
+        // track each shape by its head, the part nearest an overhead sensor,
+        // instead of its centroid; headBand in millimetres below the nearest point
+        bool trackHeads;
+        float headBand;
+        // frames whose 16x16 tiles all differ from the last segmented frame
+        // by less than this many mm on average reuse its shapes; 0 disables
+        float motionThreshold;
+        // a static scene is still segmented this often
+        int motionRefreshFrames;
+        // with no tracks for this long only every idleCheckInterval-th frame
+        // is checked for motion until some shows up; 0 disables, as does
+        // turning motion detection off
+        int idleAfterMs;
+        int idleCheckInterval;
+        // between full scans every fullScanInterval frames, look for tracked
+        // shapes only near their predicted boxes, grown by at least roiMargin px
+        bool roiTracking;
+        int fullScanInterval;
+        int roiMargin;
+        // velocity from sparse optical flow instead of centroid differences,
+        // and matching against where tracks are predicted to be
+        bool opticalFlow;
+        // follow features in the images from setFlowImage rather than in the
+        // depth image; only with depth-to-color registration enabled on the
+        // device, otherwise boxes land on the wrong pixels
+        bool flowFromColor;
+        // per-track gates from depth, speed and time unmatched, from
+        // minGateMetres up to maxMatchMetres, growing gateGrowth m/s
+        bool adaptiveGating;
+        float minGateMetres;
+        float gateGrowth;
+        // new shapes that look like a track lost less than reidMaxAgeMs ago,
+        // within reidMaxDistance in appearance, take back its ID if they are
+        // within minGateMetres plus gateGrowth m/s of where it was lost;
+        // off until evaluated in batch
+        bool reidentify;
+        int reidMaxAgeMs;
+        float reidMaxDistance;
+        // with a classifier loaded, blobs it scores below this are not
+        // people and are dropped before matching
+        float personThreshold;
+        // weight of outline difference (summed log Hu moments) against
+        // distance as a fraction of the gate when matching; 0 disables
+        float shapeWeight;
+        // tracks not matched for this long (in sensor time) are dropped
+        int trackExpiryMs;
+    };
+
+    struct IdleStats {
+        IdleStats();
+
+        uint32_t idlePeriods;
+        // sensor time spent idle in periods that have ended
+        uint64_t idleMicros;
+        uint64_t skippedFrames;
+        // sensor time between the last quiet check and the frame that woke
+        float lastWakeLatencyMs;
+    };
+
+    Tracker();
+
+    // safe to call from another thread, picked up at the start of the next frame
+    void setParams( const Params &params );
+    Params getParams();
+
+    void reset();
+    void process( const cv::Mat &depth, uint64_t timestamp );
+    // 8-bit gray color or IR frame registered to depth and its sensor
+    // timestamp, for optical flow with flowFromColor; safe to call from
+    // another thread, the latest one is used next frame
+    void setFlowImage( const cv::Mat &gray, uint64_t timestamp );
+    // random forest model from BlobClassifier::train; call before processing
+    bool loadClassifier( const std::string &path );
+
+    const cv::Mat& getDepth() const { return mInput; }
+    const cv::Mat& getWithoutBlack() const { return mWithoutBlack; }
+    const cv::Mat& getEightBit() const { return mEightBit; }
+    // thresholded mask the contours were found in
+    const cv::Mat& getForeground() const { return mForeground; }
+    const FloorPlane& getFloor() const { return mFloor; }
+    const TopDownGrid& getGrid() const { return mGrid; }
+    const ContourVector& getContours() const { return mContours; }
+    const std::vector<Shape>& getShapes() const { return mShapes; }
+    // in ascending ID order
+    const std::vector<Shape>& getTrackedShapes() const { return mTrackedShapes; }
+    // enter / update / exit decisions made for the last frame
+    const std::vector<TrackEvent>& getEvents() const { return mEvents; }
+    // the last frame reused the previous segmentation
+    bool wasStatic() const { return mStatic; }
+    // idle frames are skipped after a motion check; shapes, contours and
+    // masks are left from the last processed frame. Safe from any thread
+    bool isIdle() const { return mIdle; }
+    // a copy, safe from any thread
+    IdleStats getIdleStats() const;
+    // running mean of candidate shapes checked per track when matching;
+    // safe from any thread
+    float getCandidatesPerTrack() const { return mCandidatesPerTrack; }
+
+private:
+    bool skipWhileIdle( uint64_t timestamp );
+    bool isStatic();
+    void segment();
+    void segmentTracked( uint64_t timestamp );
+    void findShapes( const std::vector<cv::Rect> &windows );
+    std::vector< Shape > getEvaluationSet( const ContourVector &rawContours, int minimalArea, int maxArea );
+    void splitMerged( std::vector< Shape > &shapes );
+    ContourVector splitShape( const Shape &shape );
+    void measureShapes( std::vector< Shape > &shapes );
+    void computeHuMoments( std::vector< Shape > &shapes );
+    void classifyShapes( std::vector< Shape > &shapes );
+    void findHeads( std::vector< Shape > &shapes );
+    void updateFlow( uint64_t timestamp );
+    void predict( const Shape &track, uint64_t timestamp, cv::Point &centroid, cv::Point3f &position );
+    void computeAppearance( Shape &shape );
+    void gate( const Shape &track, uint64_t timestamp, const cv::Point3f &position, float &metres, float &pixels );
+    Shape* findNearestMatch( const cv::Point &centroid, const cv::Point3f &position, const Shape &track, std::vector< Shape > &shapes, float maximumDistance, float maximumMetres, int &checked );
+    cv::Mat removeBlack( const cv::Mat &input, short nearLimit, short farLimit );
+
+    std::mutex mParamsMutex;
+    Params mPendingParams;
+    Params mParams;
+
+    int shapeUID;
+
+    cv::Mat mInput;
+    cv::Mat mWithoutBlack;
+    cv::Mat mEightBit;
+    cv::Mat mForeground;
+    // last frame that was segmented
+    cv::Mat mPreviousFrame;
+    int mStaticFrames;
+    bool mStatic;
+    // read from other threads
+    std::atomic<bool> mIdle;
+    int mIdleFrames;
+    uint64_t mLastActiveTimestamp;
+    uint64_t mIdleSince;
+    uint64_t mLastIdleCheck;
+    IdleStats mIdleStats;
+    mutable std::mutex mIdleStatsMutex;
+    int mFramesSinceScan;
+    uint32_t mFrameCount;
+
+    MotionFlow mFlow;
+    std::mutex mFlowMutex;
+    cv::Mat mPendingFlowImage;
+    uint64_t mPendingFlowTimestamp;
+    bool mFlowImageSupplied;
+    // which image the flow's history comes from
+    bool mFlowFromColor;
+    std::atomic<float> mCandidatesPerTrack;
+    ReIdentifier mReidentifier;
+    BlobClassifier mClassifier;
+    cv::Mat mBackground;
+    DepthProjector mProjector;
+    FloorPlane mFloor;
+    TopDownGrid mGrid;
+    // filled outline of the shape being measured
+    cv::Mat mShapeMask;
+
+    ContourVector mContours;
+    ContourVector mApproxContours;
+    cv::vector<cv::Vec4i> mHierarchy;
+    std::vector<Shape> mShapes;
+    std::vector<Shape> mTrackedShapes;
+    std::vector<TrackEvent> mEvents;
+};
@@ -0,0 +1,409 @@
+//
+//  TrajectoryIndex.cpp
+//  MotionTrackingTest
+//
+
+#include "TrajectoryIndex.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <set>
+
+using namespace std;
+
+namespace {
+    const char MAGIC[4] = { 'M', 'T', 'T', 'I' };
+    const uint32_t VERSION = 1;
+
+    bool pointInPolygon( double x, double y, const vector<cv::Point> &polygon ){
+        bool inside = false;
+        for( size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++ ){
+            const cv::Point &a = polygon[i];
+            const cv::Point &b = polygon[j];
+            if( ( a.y > y ) != ( b.y > y ) && x < ( b.x - a.x ) * ( y - a.y ) / (double)( b.y - a.y ) + a.x ){
+                inside = ! inside;
+            }
+        }
+        return inside;
+    }
+
+    double cross( double ax, double ay, double bx, double by, double cx, double cy ){
+        return ( bx - ax ) * ( cy - ay ) - ( by - ay ) * ( cx - ax );
+    }
+
+    bool segmentsIntersect( double ax, double ay, double bx, double by, double cx, double cy, double dx, double dy ){
+        double d1 = cross( cx, cy, dx, dy, ax, ay );
+        double d2 = cross( cx, cy, dx, dy, bx, by );
+        double d3 = cross( ax, ay, bx, by, cx, cy );
+        double d4 = cross( ax, ay, bx, by, dx, dy );
+        if( ( ( d1 > 0 && d2 < 0 ) || ( d1 < 0 && d2 > 0 ) ) && ( ( d3 > 0 && d4 < 0 ) || ( d3 < 0 && d4 > 0 ) ) ){
+            return true;
+        }
+        // touching or collinear counts as crossing
+        return ( d1 == 0 && min( cx, dx ) <= ax && ax <= max( cx, dx ) && min( cy, dy ) <= ay && ay <= max( cy, dy ) ) ||
+               ( d2 == 0 && min( cx, dx ) <= bx && bx <= max( cx, dx ) && min( cy, dy ) <= by && by <= max( cy, dy ) ) ||
+               ( d3 == 0 && min( ax, bx ) <= cx && cx <= max( ax, bx ) && min( ay, by ) <= cy && cy <= max( ay, by ) ) ||
+               ( d4 == 0 && min( ax, bx ) <= dx && dx <= max( ax, bx ) && min( ay, by ) <= dy && dy <= max( ay, by ) );
+    }
+
+    bool segmentEntersPolygon( double ax, double ay, double bx, double by, const vector<cv::Point> &polygon ){
+        if( pointInPolygon( ax, ay, polygon ) || pointInPolygon( bx, by, polygon ) ){
+            return true;
+        }
+        for( size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++ ){
+            if( segmentsIntersect( ax, ay, bx, by, polygon[j].x, polygon[j].y, polygon[i].x, polygon[i].y ) ){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Liang-Barsky clip of a segment against an axis-aligned box
+    bool segmentHitsBox( double ax, double ay, double bx, double by, double x0, double y0, double x1, double y1 ){
+        double t0 = 0, t1 = 1;
+        double dx = bx - ax, dy = by - ay;
+        double p[4] = { -dx, dx, -dy, dy };
+        double q[4] = { ax - x0, x1 - ax, ay - y0, y1 - ay };
+        for( int i = 0; i < 4; i++ ){
+            if( p[i] == 0 ){
+                if( q[i] < 0 ){
+                    return false;
+                }
+            } else {
+                double t = q[i] / p[i];
+                if( p[i] < 0 ){
+                    t0 = max( t0, t );
+                } else {
+                    t1 = min( t1, t );
+                }
+                if( t0 > t1 ){
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    template<typename T>
+    void put( FILE* file, const T &value ){
+        fwrite( &value, sizeof( T ), 1, file );
+    }
+
+    template<typename T>
+    bool get( FILE* file, T &value ){
+        return fread( &value, sizeof( T ), 1, file ) == 1;
+    }
+}
+
+TrajectoryIndex::Params::Params() :
+bucketMicros(60000000),
+width(640),
+height(480),
+cellSize(20),
+maxGapMicros(1000000)
+{
+}
+
+TrajectoryIndex::TrajectoryIndex( const Params &params ) :
+mParams(params),
+mColumns((params.width + params.cellSize - 1) / params.cellSize),
+mRows((params.height + params.cellSize - 1) / params.cellSize),
+mIndexedBlocks(0),
+mOpenBucket(0)
+{
+}
+
+void TrajectoryIndex::update( const TrajectoryLogReader &log ){
+    const vector<TrajectoryLogReader::Block> &blocks = log.getBlocks();
+    vector<TrajectoryPoint> points;
+    while( mIndexedBlocks < blocks.size() ){
+        points.clear();
+        if( ! log.decodeBlock( mIndexedBlocks, points ) ){
+            MT_LOG_ERROR( "trajectory index: corrupt block", mIndexedBlocks );
+            points.clear();
+        }
+        addBlock( points, blocks[mIndexedBlocks].lastTimestamp );
+    }
+}
+
+void TrajectoryIndex::addBlock( const vector<TrajectoryPoint> &points, uint64_t lastTimestamp ){
+    for( const TrajectoryPoint &p : points ){
+        addPoint( mIndexedBlocks, p );
+    }
+    mIndexedBlocks++;
+
+    // buckets the log has moved past will not change again
+    uint64_t current = lastTimestamp / mParams.bucketMicros;
+    for( map<uint64_t, Bucket>::iterator it = mBuckets.lower_bound( mOpenBucket ); it != mBuckets.end() && it->first < current; ++it ){
+        finishBucket( it->second );
+    }
+    mOpenBucket = max( mOpenBucket, current );
+    for( map<int32_t, Track>::iterator it = mTracks.begin(); it != mTracks.end(); ){
+        if( lastTimestamp - it->second.point.timestamp > mParams.maxGapMicros ){
+            mTracks.erase( it++ );
+        } else {
+            ++it;
+        }
+    }
+}
+
+void TrajectoryIndex::addPoint( uint32_t block, const TrajectoryPoint &p ){
+    uint64_t key = p.timestamp / mParams.bucketMicros;
+    Bucket &bucket = mBuckets[key];
+    bucket.firstBlock = min( bucket.firstBlock, block );
+    bucket.lastBlock = max( bucket.lastBlock, block );
+
+    map<int32_t, Track>::iterator it = mTracks.find( p.ID );
+    if( it != mTracks.end() && p.timestamp > it->second.point.timestamp && p.timestamp - it->second.point.timestamp <= mParams.maxGapMicros ){
+        Track &track = it->second;
+        // a segment straddling buckets belongs to both
+        uint64_t previousKey = track.point.timestamp / mParams.bucketMicros;
+        if( previousKey != key ){
+            addSegment( previousKey, track, track.point, p );
+        }
+        addSegment( key, track, track.point, p );
+        track.point = p;
+    } else {
+        Track &track = mTracks[p.ID];
+        track.bucket = UINT64_MAX;
+        track.cell = -1;
+        track.point = p;
+        addSegment( key, track, p, p );
+    }
+}
+
+// every grid cell the centroid segment passes through, walked cell by cell
+void TrajectoryIndex::addSegment( uint64_t key, Track &track, const TrajectoryPoint &from, const TrajectoryPoint &to ){
+    Bucket &bucket = mBuckets[key];
+    double x0 = (double)from.x / mParams.cellSize, y0 = (double)from.y / mParams.cellSize;
+    double x1 = (double)to.x / mParams.cellSize, y1 = (double)to.y / mParams.cellSize;
+    int cx = (int)floor( x0 ), cy = (int)floor( y0 );
+    int ex = (int)floor( x1 ), ey = (int)floor( y1 );
+    double dx = x1 - x0, dy = y1 - y0;
+    int stepX = dx > 0 ? 1 : -1, stepY = dy > 0 ? 1 : -1;
+    double tMaxX = dx != 0 ? ( cx + ( stepX > 0 ) - x0 ) / dx : INFINITY;
+    double tMaxY = dy != 0 ? ( cy + ( stepY > 0 ) - y0 ) / dy : INFINITY;
+    double tDeltaX = dx != 0 ? stepX / dx : INFINITY;
+    double tDeltaY = dy != 0 ? stepY / dy : INFINITY;
+
+    int steps = abs( ex - cx ) + abs( ey - cy );
+    for( int i = 0; i <= steps; i++ ){
+        int cell = cy * mColumns + cx;
+        // most segments stay in the cell the last one ended in
+        if( cx >= 0 && cx < mColumns && cy >= 0 && cy < mRows && ( cell != track.cell || key != track.bucket ) ){
+            Entry entry = { (uint16_t)cell, from.ID };
+            bucket.entries.push_back( entry );
+            bucket.sorted = false;
+            track.cell = cell;
+            track.bucket = key;
+        }
+        if( tMaxX < tMaxY ){
+            tMaxX += tDeltaX;
+            cx += stepX;
+        } else {
+            tMaxY += tDeltaY;
+            cy += stepY;
+        }
+    }
+}
+
+void TrajectoryIndex::finishBucket( Bucket &bucket ){
+    if( ! bucket.sorted ){
+        sort( bucket.entries.begin(), bucket.entries.end() );
+        bucket.entries.erase( unique( bucket.entries.begin(), bucket.entries.end() ), bucket.entries.end() );
+        bucket.entries.shrink_to_fit();
+        bucket.sorted = true;
+    }
+}
+
+vector<int32_t> TrajectoryIndex::query( const TrajectoryLogReader &log, uint64_t begin, uint64_t end, const cv::Rect &rect ) const {
+    vector<cv::Point> polygon;
+    polygon.push_back( rect.tl() );
+    polygon.push_back( cv::Point( rect.x + rect.width, rect.y ) );
+    polygon.push_back( rect.br() );
+    polygon.push_back( cv::Point( rect.x, rect.y + rect.height ) );
+    return query( log, begin, end, polygon );
+}
+
+vector<int32_t> TrajectoryIndex::query( const TrajectoryLogReader &log, uint64_t begin, uint64_t end, const vector<cv::Point> &polygon ) const {
+    vector<int32_t> result;
+    if( polygon.size() < 3 || begin > end ){
+        return result;
+    }
+
+    // classify cells once: 1 touches the polygon's edge, 2 lies wholly inside
+    vector<uint8_t> cells( mColumns * mRows, 0 );
+    cv::Point lo = polygon[0], hi = polygon[0];
+    for( const cv::Point &p : polygon ){
+        lo = cv::Point( min( lo.x, p.x ), min( lo.y, p.y ) );
+        hi = cv::Point( max( hi.x, p.x ), max( hi.y, p.y ) );
+    }
+    int c0 = max( 0, lo.x / mParams.cellSize ), c1 = min( mColumns - 1, hi.x / mParams.cellSize );
+    int r0 = max( 0, lo.y / mParams.cellSize ), r1 = min( mRows - 1, hi.y / mParams.cellSize );
+    for( int r = r0; r <= r1; r++ ){
+        for( int c = c0; c <= c1; c++ ){
+            double x0 = c * mParams.cellSize, y0 = r * mParams.cellSize;
+            double x1 = x0 + mParams.cellSize, y1 = y0 + mParams.cellSize;
+            bool edge = false;
+            for( size_t i = 0, j = polygon.size() - 1; i < polygon.size() && ! edge; j = i++ ){
+                edge = segmentHitsBox( polygon[j].x, polygon[j].y, polygon[i].x, polygon[i].y, x0, y0, x1, y1 );
+            }
+            cells[r * mColumns + c] = edge ? 1 : pointInPolygon( ( x0 + x1 ) / 2, ( y0 + y1 ) / 2, polygon ) ? 2 : 0;
+        }
+    }
+
+    set<int32_t> accepted;
+    // tracks that need their points checked, and the blocks that hold them
+    set<int32_t> candidates;
+    uint32_t firstBlock = UINT32_MAX, lastBlock = 0;
+
+    uint64_t firstKey = begin / mParams.bucketMicros, lastKey = end / mParams.bucketMicros;
+    for( map<uint64_t, Bucket>::const_iterator it = mBuckets.lower_bound( firstKey ); it != mBuckets.end() && it->first <= lastKey; ++it ){
+        const Bucket &bucket = it->second;
+        // a bucket the range only partly covers can't vouch for any track
+        bool whole = it->first * mParams.bucketMicros >= begin && ( it->first + 1 ) * mParams.bucketMicros - 1 <= end;
+        bool needsBlocks = false;
+        for( const Entry &entry : bucket.entries ){
+            uint8_t cell = cells[entry.cell];
+            if( cell == 2 && whole ){
+                accepted.insert( entry.ID );
+            } else if( cell != 0 ){
+                candidates.insert( entry.ID );
+                needsBlocks = true;
+            }
+        }
+        if( needsBlocks ){
+            firstBlock = min( firstBlock, bucket.firstBlock );
+            lastBlock = max( lastBlock, bucket.lastBlock );
+        }
+    }
+    for( int32_t ID : accepted ){
+        candidates.erase( ID );
+    }
+
+    if( ! candidates.empty() ){
+        // blocks are in time order, so the previous point of each track carries over
+        map<int32_t, TrajectoryPoint> previous;
+        vector<TrajectoryPoint> points;
+        for( uint32_t block = firstBlock; block <= lastBlock && block < log.getBlocks().size() && ! candidates.empty(); block++ ){
+            const TrajectoryLogReader::Block &info = log.getBlocks()[block];
+            if( info.lastTimestamp + mParams.maxGapMicros < begin || info.firstTimestamp > end ){
+                continue;
+            }
+            points.clear();
+            if( ! log.decodeBlock( block, points ) ){
+                continue;
+            }
+            for( const TrajectoryPoint &p : points ){
+                if( p.timestamp > end || ! candidates.count( p.ID ) ){
+                    continue;
+                }
+                map<int32_t, TrajectoryPoint>::iterator last = previous.find( p.ID );
+                bool joined = last != previous.end() && p.timestamp - last->second.timestamp <= mParams.maxGapMicros;
+                bool hit = false;
+                if( p.timestamp >= begin ){
+                    hit = joined ? segmentEntersPolygon( last->second.x, last->second.y, p.x, p.y, polygon ) : pointInPolygon( p.x, p.y, polygon );
+                }
+                if( hit ){
+                    accepted.insert( p.ID );
+                    candidates.erase( p.ID );
+                    previous.erase( p.ID );
+                } else {
+                    previous[p.ID] = p;
+                }
+            }
+        }
+    }
+
+    result.assign( accepted.begin(), accepted.end() );
+    return result;
+}
+
+bool TrajectoryIndex::save( const string &path ) const {
+    FILE* file = fopen( path.c_str(), "wb" );
+    if( file == NULL ){
+        MT_LOG_ERROR( "trajectory index: could not open file for writing" );
+        return false;
+    }
+    fwrite( MAGIC, 1, 4, file );
+    put( file, VERSION );
+    put( file, mParams.bucketMicros );
+    put<int32_t>( file, mParams.width );
+    put<int32_t>( file, mParams.height );
+    put<int32_t>( file, mParams.cellSize );
+    put( file, mParams.maxGapMicros );
+    put<uint64_t>( file, mIndexedBlocks );
+
+    put<uint64_t>( file, mBuckets.size() );
+    for( const auto &it : mBuckets ){
+        put( file, it.first );
+        put( file, it.second.firstBlock );
+        put( file, it.second.lastBlock );
+        put<uint8_t>( file, it.second.sorted );
+        put<uint64_t>( file, it.second.entries.size() );
+        fwrite( it.second.entries.data(), sizeof( Entry ), it.second.entries.size(), file );
+    }
+    put<uint64_t>( file, mTracks.size() );
+    for( const auto &it : mTracks ){
+        put( file, it.second );
+    }
+    bool ok = ferror( file ) == 0;
+    fclose( file );
+    if( ! ok ){
+        MT_LOG_ERROR( "trajectory index: write failed" );
+    }
+    return ok;
+}
+
+bool TrajectoryIndex::load( const string &path ){
+    FILE* file = fopen( path.c_str(), "rb" );
+    if( file == NULL ){
+        return false;
+    }
+    char magic[4];
+    uint32_t version;
+    Params params;
+    int32_t width, height, cellSize;
+    uint64_t indexedBlocks, numBuckets, numTracks;
+    bool ok = fread( magic, 1, 4, file ) == 4 && memcmp( magic, MAGIC, 4 ) == 0 && get( file, version ) && version == VERSION &&
+        get( file, params.bucketMicros ) && get( file, width ) && get( file, height ) && get( file, cellSize ) &&
+        get( file, params.maxGapMicros ) && get( file, indexedBlocks ) && get( file, numBuckets );
+    params.width = width;
+    params.height = height;
+    params.cellSize = cellSize;
+
+    map<uint64_t, Bucket> buckets;
+    for( uint64_t i = 0; ok && i < numBuckets; i++ ){
+        uint64_t key, numEntries;
+        uint8_t sorted;
+        Bucket bucket;
+        ok = get( file, key ) && get( file, bucket.firstBlock ) && get( file, bucket.lastBlock ) && get( file, sorted ) && get( file, numEntries );
+        if( ok ){
+            bucket.sorted = sorted != 0;
+            bucket.entries.resize( numEntries );
+            ok = fread( bucket.entries.data(), sizeof( Entry ), numEntries, file ) == numEntries;
+            buckets[key] = bucket;
+        }
+    }
+    map<int32_t, Track> tracks;
+    ok = ok && get( file, numTracks );
+    for( uint64_t i = 0; ok && i < numTracks; i++ ){
+        Track track;
+        ok = get( file, track );
+        tracks[track.point.ID] = track;
+    }
+    fclose( file );
+    if( ! ok ){
+        MT_LOG_ERROR( "trajectory index: not a trajectory index" );
+        return false;
+    }
+
+    *this = TrajectoryIndex( params );
+    mIndexedBlocks = indexedBlocks;
+    mBuckets.swap( buckets );
+    mTracks.swap( tracks );
+    return true;
+}
@@ -0,0 +1,93 @@
+//
+//  TrajectoryIndex.h
+//  MotionTrackingTest
+//
+//  Spatio-temporal index over a trajectory log, for questions like "which
+//  tracks passed through this doorway in this hour". Time is cut into fixed
+//  buckets and the depth image into a coarse grid; each bucket keeps the
+//  (cell, track) pairs its centroid paths crossed and the log blocks that
+//  cover it. Queries accept tracks seen in cells wholly inside the region
+//  straight from the index, and only decode log blocks to check tracks seen
+//  in cells on the region's edge or in buckets the time range cuts through.
+//
+//  The index grows one log block at a time and can be saved next to the log,
+//  so a long-running capture is never indexed from scratch. The log writer
+//  keeps one as it flushes blocks, saved as <log>.idx, and a reader only has
+//  to index the blocks written since the last save.
+//
+
+#pragma once
+#include "TrajectoryLog.h"
+
+#include <map>
+
+class TrajectoryIndex {
+public:
+    struct Params {
+        Params();
+
+        uint64_t bucketMicros;
+        // grid covers [0, width) x [0, height) in depth image pixels
+        int width;
+        int height;
+        int cellSize;
+        // consecutive centroids further apart in time are not joined
+        uint64_t maxGapMicros;
+    };
+
+    explicit TrajectoryIndex( const Params &params = Params() );
+
+    // indexes blocks the log has gained since the last call
+    void update( const TrajectoryLogReader &log );
+    // indexes the next block from its points, for a writer that has them
+    // without decoding; lastTimestamp is the block's last frame
+    void addBlock( const std::vector<TrajectoryPoint> &points, uint64_t lastTimestamp );
+    size_t getIndexedBlocks() const { return mIndexedBlocks; }
+
+    // IDs of tracks whose centroid path entered the polygon between begin and
+    // end (log timestamps, us), ascending
+    std::vector<int32_t> query( const TrajectoryLogReader &log, uint64_t begin, uint64_t end, const std::vector<cv::Point> &polygon ) const;
+    std::vector<int32_t> query( const TrajectoryLogReader &log, uint64_t begin, uint64_t end, const cv::Rect &rect ) const;
+
+    bool save( const std::string &path ) const;
+    bool load( const std::string &path );
+
+private:
+    struct Entry {
+        uint16_t cell;
+        int32_t ID;
+
+        bool operator<( const Entry &other ) const { return cell < other.cell || ( cell == other.cell && ID < other.ID ); }
+        bool operator==( const Entry &other ) const { return cell == other.cell && ID == other.ID; }
+    };
+
+    struct Bucket {
+        Bucket() : firstBlock( UINT32_MAX ), lastBlock( 0 ), sorted( true ) {}
+
+        uint32_t firstBlock;
+        uint32_t lastBlock;
+        std::vector<Entry> entries;
+        bool sorted;
+    };
+
+    // where a live track was last seen, to join it to its next point and to
+    // skip repeats of the cell it is standing in
+    struct Track {
+        TrajectoryPoint point;
+        uint64_t bucket;
+        int cell;
+    };
+
+    void addPoint( uint32_t block, const TrajectoryPoint &p );
+    void addSegment( uint64_t key, Track &track, const TrajectoryPoint &from, const TrajectoryPoint &to );
+    void finishBucket( Bucket &bucket );
+
+    Params mParams;
+    int mColumns;
+    int mRows;
+    size_t mIndexedBlocks;
+    // buckets before this one are finished
+    uint64_t mOpenBucket;
+    std::map<uint64_t, Bucket> mBuckets;
+    std::map<int32_t, Track> mTracks;
+};
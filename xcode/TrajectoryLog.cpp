@@ -0,0 +1,512 @@
+//
+//  TrajectoryLog.cpp
+//  MotionTrackingTest
+//
+
+#include "TrajectoryLog.h"
+#include "TrajectoryIndex.h"
+#include "Logger.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    const char MAGIC[4] = { 'M', 'T', 'T', 'L' };
+    const uint32_t VERSION = 2;
+    const size_t HEADER_SIZE = 16;
+    // version 1 headers stop before the epoch
+    const size_t HEADER_SIZE_V1 = 8;
+    const size_t EPOCH_OFFSET = 8;
+    const size_t BLOCK_HEADER_SIZE = 24;
+    // blocks are written once they reach this size or age, whichever is first
+    const size_t BLOCK_BYTES = 64 * 1024;
+    const uint64_t BLOCK_MICROS = 5000000;
+    // bound on points queued for the log thread before new ones are dropped
+    const size_t MAX_PENDING = 1 << 18;
+    // marks a frame with no tracks following one that had some
+    const int32_t EMPTY_FRAME = -1;
+    // the index is rewritten after this many blocks, about a minute, and on
+    // close; a reader indexes whatever came after the last save itself
+    const uint32_t INDEX_SAVE_BLOCKS = 12;
+
+    template<typename T>
+    uint8_t* put( uint8_t* out, T value ){
+        memcpy( out, &value, sizeof( T ) );
+        return out + sizeof( T );
+    }
+
+    template<typename T>
+    const uint8_t* get( const uint8_t* in, T &value ){
+        memcpy( &value, in, sizeof( T ) );
+        return in + sizeof( T );
+    }
+
+    inline void putVarint( std::vector<uint8_t> &out, uint64_t value ){
+        while( value >= 0x80 ){
+            out.push_back( (uint8_t)value | 0x80 );
+            value >>= 7;
+        }
+        out.push_back( (uint8_t)value );
+    }
+
+    inline void putSigned( std::vector<uint8_t> &out, int64_t value ){
+        putVarint( out, ( (uint64_t)value << 1 ) ^ (uint64_t)( value >> 63 ) );
+    }
+
+    // returns NULL if the varint runs past end
+    inline const uint8_t* getVarint( const uint8_t* in, const uint8_t* end, uint64_t &value ){
+        if( in != end && *in < 0x80 ){
+            value = *in;
+            return in + 1;
+        }
+        value = 0;
+        for( int shift = 0; in != end && shift < 64; shift += 7 ){
+            uint8_t byte = *in++;
+            value |= (uint64_t)( byte & 0x7f ) << shift;
+            if( ! ( byte & 0x80 ) ){
+                return in;
+            }
+        }
+        return NULL;
+    }
+
+    inline const uint8_t* getSigned( const uint8_t* in, const uint8_t* end, int64_t &value ){
+        uint64_t raw;
+        in = getVarint( in, end, raw );
+        value = (int64_t)( raw >> 1 ) ^ -(int64_t)( raw & 1 );
+        return in;
+    }
+
+    // unchecked; only used with at least MAX_VARINT_BYTES left
+    const size_t MAX_VARINT_BYTES = 10;
+
+    inline const uint8_t* getVarintFast( const uint8_t* in, uint64_t &value ){
+        uint64_t byte = *in++;
+        value = byte & 0x7f;
+        for( int shift = 7; byte & 0x80 && shift < 64; shift += 7 ){
+            byte = *in++;
+            value |= ( byte & 0x7f ) << shift;
+        }
+        return in;
+    }
+
+    inline const uint8_t* getSignedFast( const uint8_t* in, int64_t &value ){
+        uint64_t raw;
+        in = getVarintFast( in, raw );
+        value = (int64_t)( raw >> 1 ) ^ -(int64_t)( raw & 1 );
+        return in;
+    }
+
+    // one track in a frame: ID delta plus seven field deltas
+    const size_t FIELDS = 7;
+    const size_t MAX_POINT_BYTES = ( 1 + FIELDS ) * MAX_VARINT_BYTES;
+
+    uint64_t nowMicros(){
+        return std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+    }
+
+    uint64_t wallClockMicros(){
+        return std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::system_clock::now().time_since_epoch() ).count();
+    }
+}
+
+TrajectoryLogWriter::TrajectoryLogWriter() :
+mFile(NULL),
+mEpoch(0),
+mEpochWritten(false),
+mPreviousEmpty(true),
+mDropped(0),
+mRunning(false),
+mBlockFrames(0),
+mBlockFirst(0),
+mBlockLast(0),
+mBlockStarted(0),
+mUnsavedBlocks(0)
+{
+}
+
+TrajectoryLogWriter::~TrajectoryLogWriter(){
+    close();
+}
+
+bool TrajectoryLogWriter::open( const std::string &path ){
+    close();
+
+    mFile = fopen( path.c_str(), "wb" );
+    if( mFile == NULL ){
+        MT_LOG_ERROR( "trajectory log: could not open file for writing" );
+        return false;
+    }
+    uint8_t header[HEADER_SIZE];
+    memcpy( header, MAGIC, 4 );
+    put<uint32_t>( header + 4, VERSION );
+    // the epoch is only known once the first frame arrives
+    put<uint64_t>( header + EPOCH_OFFSET, 0 );
+    if( fwrite( header, 1, HEADER_SIZE, mFile ) != HEADER_SIZE ){
+        fclose( mFile );
+        mFile = NULL;
+        return false;
+    }
+
+    mEpoch = 0;
+    mEpochWritten = false;
+    mPending.reserve( 4096 );
+    mPreviousEmpty = true;
+    mDropped = 0;
+    mBlock.clear();
+    mPreviousFrame.clear();
+    mBlockFrames = 0;
+    mBlockPoints.clear();
+    mIndex.reset( new TrajectoryIndex() );
+    mIndexPath = path + ".idx";
+    mUnsavedBlocks = 0;
+    mRunning = true;
+    mThread = std::thread( &TrajectoryLogWriter::run, this );
+    return true;
+}
+
+void TrajectoryLogWriter::close(){
+    if( mFile == NULL ){
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mRunning = false;
+    }
+    mCondition.notify_one();
+    mThread.join();
+    writeBlock();
+    saveIndex();
+    if( mDropped ){
+        MT_LOG_WARN( "trajectory log: points dropped", mDropped );
+    }
+    fclose( mFile );
+    mFile = NULL;
+}
+
+void TrajectoryLogWriter::append( uint64_t timestamp, const std::vector<Shape> &trackedShapes ){
+    if( mFile != NULL && mEpoch == 0 ){
+        mEpoch = wallClockMicros() - timestamp;
+    }
+    if( mFile == NULL || ( trackedShapes.empty() && mPreviousEmpty ) ){
+        return;
+    }
+    std::lock_guard<std::mutex> lock( mMutex );
+    if( mPending.size() + trackedShapes.size() + 1 > MAX_PENDING ){
+        mDropped += trackedShapes.size();
+        return;
+    }
+    if( trackedShapes.empty() ){
+        TrajectoryPoint p = { timestamp, EMPTY_FRAME, 0, 0, 0, 0, 0, 0, 0 };
+        mPending.push_back( p );
+    }
+    for( const Shape &shape : trackedShapes ){
+        TrajectoryPoint p = { timestamp, shape.ID, shape.centroid.x, shape.centroid.y, (int32_t)lround( shape.area ),
+            shape.boundingRect.x, shape.boundingRect.y, shape.boundingRect.width, shape.boundingRect.height };
+        mPending.push_back( p );
+    }
+    mPreviousEmpty = trackedShapes.empty();
+    // wake the log thread early rather than start dropping
+    if( mPending.size() >= MAX_PENDING / 2 ){
+        mCondition.notify_one();
+    }
+}
+
+void TrajectoryLogWriter::run(){
+    std::vector<TrajectoryPoint> points;
+    std::unique_lock<std::mutex> lock( mMutex );
+    for(;;){
+        mCondition.wait_for( lock, std::chrono::milliseconds( 250 ), [this]{ return ! mRunning || mPending.size() >= MAX_PENDING / 2; } );
+        // keeps both buffers' capacity, so append() rarely allocates
+        points.clear();
+        points.swap( mPending );
+        bool running = mRunning;
+        lock.unlock();
+
+        encode( points );
+        if( ! mBlock.empty() && ( mBlock.size() >= BLOCK_BYTES || nowMicros() - mBlockStarted >= BLOCK_MICROS ) ){
+            writeBlock();
+        }
+
+        lock.lock();
+        if( ! running ){
+            break;
+        }
+    }
+}
+
+void TrajectoryLogWriter::encode( const std::vector<TrajectoryPoint> &points ){
+    size_t begin = 0;
+    for( size_t i = 1; i <= points.size(); i++ ){
+        if( i == points.size() || points[i].timestamp != points[begin].timestamp ){
+            encodeFrame( &points[begin], &points[0] + i );
+            begin = i;
+        }
+    }
+}
+
+void TrajectoryLogWriter::encodeFrame( const TrajectoryPoint* first, const TrajectoryPoint* last ){
+    uint64_t timestamp = first->timestamp;
+    if( mBlock.empty() ){
+        mBlockFirst = timestamp;
+        mBlockStarted = nowMicros();
+        mPreviousFrame.clear();
+        mBlockLast = 0;
+    }
+    mCurrentFrame.assign( first, first->ID == EMPTY_FRAME ? first : last );
+
+    putSigned( mBlock, (int64_t)( timestamp - mBlockLast ) );
+    putVarint( mBlock, mCurrentFrame.size() );
+
+    // both frames are in ascending ID order, so matching is a single merge walk
+    size_t previous = 0;
+    int32_t previousID = 0;
+    for( const TrajectoryPoint &p : mCurrentFrame ){
+        while( previous < mPreviousFrame.size() && mPreviousFrame[previous].ID < p.ID ){
+            previous++;
+        }
+        TrajectoryPoint base = {};
+        if( previous < mPreviousFrame.size() && mPreviousFrame[previous].ID == p.ID ){
+            base = mPreviousFrame[previous];
+        }
+        putVarint( mBlock, (uint32_t)( p.ID - previousID ) );
+        putSigned( mBlock, p.x - base.x );
+        putSigned( mBlock, p.y - base.y );
+        putSigned( mBlock, p.area - base.area );
+        putSigned( mBlock, p.bx - base.bx );
+        putSigned( mBlock, p.by - base.by );
+        putSigned( mBlock, p.bw - base.bw );
+        putSigned( mBlock, p.bh - base.bh );
+        previousID = p.ID;
+    }
+    mBlockPoints.insert( mBlockPoints.end(), mCurrentFrame.begin(), mCurrentFrame.end() );
+    mPreviousFrame.swap( mCurrentFrame );
+    mBlockLast = timestamp;
+    mBlockFrames++;
+}
+
+void TrajectoryLogWriter::writeBlock(){
+    if( mBlock.empty() ){
+        return;
+    }
+    if( ! mEpochWritten && mEpoch != 0 ){
+        uint8_t epoch[8];
+        put<uint64_t>( epoch, mEpoch );
+        mEpochWritten = fseek( mFile, EPOCH_OFFSET, SEEK_SET ) == 0 && fwrite( epoch, 1, sizeof( epoch ), mFile ) == sizeof( epoch );
+        fseek( mFile, 0, SEEK_END );
+    }
+    uint8_t header[BLOCK_HEADER_SIZE];
+    uint8_t* out = header;
+    out = put<uint32_t>( out, mBlock.size() );
+    out = put<uint32_t>( out, mBlockFrames );
+    out = put<uint64_t>( out, mBlockFirst );
+    out = put<uint64_t>( out, mBlockLast );
+    if( fwrite( header, 1, BLOCK_HEADER_SIZE, mFile ) != BLOCK_HEADER_SIZE || fwrite( mBlock.data(), 1, mBlock.size(), mFile ) != mBlock.size() ){
+        MT_LOG_ERROR( "trajectory log: write failed" );
+    }
+    fflush( mFile );
+    mIndex->addBlock( mBlockPoints, mBlockLast );
+    if( ++mUnsavedBlocks >= INDEX_SAVE_BLOCKS ){
+        saveIndex();
+    }
+    mBlock.clear();
+    mBlockPoints.clear();
+    mBlockFrames = 0;
+}
+
+// written aside and renamed, so a query never loads half an index
+void TrajectoryLogWriter::saveIndex(){
+    if( mUnsavedBlocks == 0 ){
+        return;
+    }
+    std::string partial = mIndexPath + ".part";
+    if( ! mIndex->save( partial ) || rename( partial.c_str(), mIndexPath.c_str() ) != 0 ){
+        MT_LOG_ERROR( "trajectory log: could not save index" );
+        remove( partial.c_str() );
+    }
+    mUnsavedBlocks = 0;
+}
+
+TrajectoryLogReader::TrajectoryLogReader() :
+mData(NULL),
+mSize(0),
+mHeaderSize(HEADER_SIZE),
+mEpoch(0)
+{
+}
+
+TrajectoryLogReader::~TrajectoryLogReader(){
+    close();
+}
+
+bool TrajectoryLogReader::open( const std::string &path ){
+    close();
+
+    mPath = path;
+    if( ! mapFile() ){
+        close();
+        return false;
+    }
+    uint32_t version;
+    get( mData + 4, version );
+    if( memcmp( mData, MAGIC, 4 ) != 0 || version < 1 || version > VERSION || ( version > 1 && mSize < HEADER_SIZE ) ){
+        MT_LOG_ERROR( "trajectory log: not a trajectory log" );
+        close();
+        return false;
+    }
+    mHeaderSize = version > 1 ? HEADER_SIZE : HEADER_SIZE_V1;
+    mEpoch = 0;
+    if( version > 1 ){
+        get( mData + EPOCH_OFFSET, mEpoch );
+    }
+    scanBlocks();
+    return true;
+}
+
+bool TrajectoryLogReader::refresh(){
+    if( mData == NULL ){
+        return false;
+    }
+    munmap( (void*)mData, mSize );
+    mData = NULL;
+    if( ! mapFile() ){
+        close();
+        return false;
+    }
+    // the writer fills in the epoch once its first frame arrives
+    if( mHeaderSize == HEADER_SIZE ){
+        get( mData + EPOCH_OFFSET, mEpoch );
+    }
+    scanBlocks();
+    return true;
+}
+
+bool TrajectoryLogReader::mapFile(){
+    int fd = ::open( mPath.c_str(), O_RDONLY );
+    if( fd < 0 ){
+        MT_LOG_ERROR( "trajectory log: could not open file for reading" );
+        return false;
+    }
+    struct stat st;
+    if( fstat( fd, &st ) != 0 || (uint64_t)st.st_size < HEADER_SIZE_V1 || (uint64_t)st.st_size > SIZE_MAX ){
+        MT_LOG_ERROR( "trajectory log: file is empty or too large to map" );
+        ::close( fd );
+        return false;
+    }
+    void* data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    ::close( fd );
+    if( data == MAP_FAILED ){
+        MT_LOG_ERROR( "trajectory log: could not map file" );
+        return false;
+    }
+    mData = (const uint8_t*)data;
+    mSize = st.st_size;
+    return true;
+}
+
+// picks up from the last complete block; one cut short, by a crash or a
+// write still in progress, ends the log for now
+void TrajectoryLogReader::scanBlocks(){
+    uint64_t offset = mBlocks.empty() ? mHeaderSize : mBlocks.back().offset + mBlocks.back().size;
+    while( offset + BLOCK_HEADER_SIZE <= mSize ){
+        Block block;
+        const uint8_t* in = mData + offset;
+        in = get( in, block.size );
+        in = get( in, block.frames );
+        in = get( in, block.firstTimestamp );
+        in = get( in, block.lastTimestamp );
+        block.offset = offset + BLOCK_HEADER_SIZE;
+        if( block.offset + block.size > mSize ){
+            break;
+        }
+        mBlocks.push_back( block );
+        offset = block.offset + block.size;
+    }
+}
+
+void TrajectoryLogReader::close(){
+    if( mData != NULL ){
+        munmap( (void*)mData, mSize );
+        mData = NULL;
+        mSize = 0;
+    }
+    mBlocks.clear();
+    mPath.clear();
+    mEpoch = 0;
+}
+
+bool TrajectoryLogReader::decodeBlock( size_t index, std::vector<TrajectoryPoint> &points ) const {
+    if( index >= mBlocks.size() ){
+        return false;
+    }
+    const Block &block = mBlocks[index];
+    const uint8_t* in = mData + block.offset;
+    const uint8_t* end = in + block.size;
+
+    // the previous frame is the tail of points, starting at previousBegin
+    size_t previousBegin = points.size();
+    size_t previousEnd = points.size();
+    uint64_t timestamp = 0;
+    for( uint32_t frame = 0; frame < block.frames; frame++ ){
+        int64_t delta;
+        uint64_t count;
+        if( ! ( in = getSigned( in, end, delta ) ) || ! ( in = getVarint( in, end, count ) ) || count > (uint64_t)( end - in ) ){
+            return false;
+        }
+        timestamp += delta;
+
+        size_t currentBegin = points.size();
+        points.resize( currentBegin + count );
+        const TrajectoryPoint* previous = &points[0] + previousBegin;
+        const TrajectoryPoint* previousLast = &points[0] + previousEnd;
+        TrajectoryPoint* out = &points[0] + currentBegin;
+        int32_t ID = 0;
+        for( uint64_t i = 0; i < count; i++, out++ ){
+            uint64_t idDelta;
+            int64_t v[FIELDS];
+            // bounds are checked per point rather than per varint where possible
+            if( (size_t)( end - in ) >= MAX_POINT_BYTES ){
+                in = getVarintFast( in, idDelta );
+                for( size_t k = 0; k < FIELDS; k++ ){
+                    in = getSignedFast( in, v[k] );
+                }
+            } else {
+                in = getVarint( in, end, idDelta );
+                for( size_t k = 0; k < FIELDS && in; k++ ){
+                    in = getSigned( in, end, v[k] );
+                }
+                if( ! in ){
+                    points.resize( currentBegin );
+                    return false;
+                }
+            }
+            ID += (int32_t)idDelta;
+
+            while( previous != previousLast && previous->ID < ID ){
+                previous++;
+            }
+            if( previous != previousLast && previous->ID == ID ){
+                *out = *previous;
+            } else {
+                *out = TrajectoryPoint();
+            }
+            out->timestamp = timestamp;
+            out->ID = ID;
+            out->x += v[0];
+            out->y += v[1];
+            out->area += v[2];
+            out->bx += v[3];
+            out->by += v[4];
+            out->bw += v[5];
+            out->bh += v[6];
+        }
+        previousBegin = currentBegin;
+        previousEnd = points.size();
+    }
+    return true;
+}
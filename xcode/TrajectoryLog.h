@@ -0,0 +1,136 @@
+//
+//  TrajectoryLog.h
+//  MotionTrackingTest
+//
+//  Append-only log of every tracked shape's centroid, area and bounding box,
+//  one record per track per depth frame, for offline analytics.
+//
+//  Layout, little-endian:
+//    header  magic "MTTL", u32 version, u64 epoch: wall-clock time (us since
+//            1970) at sensor timestamp 0 for this session, 0 if unknown;
+//            version 1 files have no epoch
+//    block   u32 payload bytes, u32 frame count, u64 first / last timestamp (us),
+//            payload
+//  Each block decodes on its own. A frame in the payload is a zig-zag varint
+//  timestamp delta, a varint track count, then per track (ascending ID) a
+//  varint ID delta and zig-zag varint deltas of x, y, area, bx, by, bw, bh
+//  against the same track in the previous frame, or against zero for a track
+//  that was not in it.
+//
+//  The writer also keeps a TrajectoryIndex over the blocks it has flushed,
+//  saved next to the log as <log>.idx.
+//
+
+#pragma once
+#include "Shape.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct TrajectoryPoint {
+    uint64_t timestamp;
+    int32_t ID;
+    int32_t x, y;
+    int32_t area;
+    int32_t bx, by, bw, bh;
+};
+
+class TrajectoryIndex;
+
+class TrajectoryLogWriter {
+public:
+    TrajectoryLogWriter();
+    ~TrajectoryLogWriter();
+
+    bool open( const std::string &path );
+    // writes out whatever is still queued, and the index
+    void close();
+    bool isOpen() const { return mFile != NULL; }
+
+    // called from the depth thread with the tracker's current shapes; only
+    // copies, encoding and file writes happen on the log's own thread
+    void append( uint64_t timestamp, const std::vector<Shape> &trackedShapes );
+
+private:
+    void run();
+    void encode( const std::vector<TrajectoryPoint> &points );
+    void encodeFrame( const TrajectoryPoint* first, const TrajectoryPoint* last );
+    void writeBlock();
+    void saveIndex();
+
+    FILE* mFile;
+    // set from the first append(), written into the header by the log thread
+    std::atomic<uint64_t> mEpoch;
+    bool mEpochWritten;
+
+    // filled by append(), swapped out by the log thread
+    std::vector<TrajectoryPoint> mPending;
+    bool mPreviousEmpty;
+    uint64_t mDropped;
+    bool mRunning;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::thread mThread;
+
+    // encoder state, log thread only
+    std::vector<uint8_t> mBlock;
+    std::vector<TrajectoryPoint> mPreviousFrame;
+    std::vector<TrajectoryPoint> mCurrentFrame;
+    uint32_t mBlockFrames;
+    uint64_t mBlockFirst;
+    uint64_t mBlockLast;
+    uint64_t mBlockStarted;
+
+    // the current block's points, indexed once it is written
+    std::vector<TrajectoryPoint> mBlockPoints;
+    std::unique_ptr<TrajectoryIndex> mIndex;
+    std::string mIndexPath;
+    uint32_t mUnsavedBlocks;
+};
+
+// Maps the log read-only; blocks are found by their headers on open and
+// decoded independently, so they can be read in any order or in parallel.
+class TrajectoryLogReader {
+public:
+    struct Block {
+        uint64_t offset;
+        uint32_t size;
+        uint32_t frames;
+        uint64_t firstTimestamp;
+        uint64_t lastTimestamp;
+    };
+
+    TrajectoryLogReader();
+    ~TrajectoryLogReader();
+
+    bool open( const std::string &path );
+    void close();
+    bool isOpen() const { return mData != NULL; }
+    // remaps the file to pick up blocks written since it was opened
+    bool refresh();
+
+    // wall-clock us since 1970 at sensor timestamp 0, 0 if the log has none;
+    // wall-clock time of a point is its timestamp plus this
+    uint64_t getEpoch() const { return mEpoch; }
+    const std::vector<Block>& getBlocks() const { return mBlocks; }
+    // appends the block's points, false on corrupt data
+    bool decodeBlock( size_t block, std::vector<TrajectoryPoint> &points ) const;
+
+private:
+    bool mapFile();
+    void scanBlocks();
+
+    std::string mPath;
+    const uint8_t* mData;
+    size_t mSize;
+    size_t mHeaderSize;
+    uint64_t mEpoch;
+    std::vector<Block> mBlocks;
+};